@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include "yalnix.h"
+
+#define MIN_CHILDREN	32
+#define MAX_CHILDREN	4096	/* the pid table holds no more */
+#define HOLD_TICKS	200	/* ticks children stay alive per 1024 of them */
+
+/*
+ * Forks N children that all stay alive until a common release tick, then
+ * reaps them, for N doubling up to MAX_CHILDREN. With O(1) process tree
+ * upkeep, the ticks all forks and all exits take should grow linearly in
+ * N, doubling with it once they are well above the one tick resolution
+ * of the clock.
+ *
+ * Every live child pins its kernel stack (KERNEL_STACK_PAGES pages) and
+ * half a page of page table, none of which can be swapped out, so physical
+ * memory usually runs out well before MAX_CHILDREN. The run then stops at
+ * the first Fork ERROR and reports the largest N that fit.
+ */
+int
+main(int argc, char **argv)
+{
+    int n, i;
+    int forked;
+    int status;
+    int start, release, forks_done, reaped;
+    int largest = 0;
+
+    setbuf(stdout, NULL);
+
+    printf("FORKBENCH> This program times Fork, Exit and Wait with many children\n");
+
+    for (n = MIN_CHILDREN; n <= MAX_CHILDREN; n *= 2) {
+	start = DelayUntil(0);
+	release = start + HOLD_TICKS * (n / 1024 + 1);
+	for (forked = 0; forked < n; forked++) {
+	    i = Fork();
+	    if (i == 0) {
+		DelayUntil(release);
+		Exit(forked);
+	    }
+	    if (i == ERROR)
+		break;
+	}
+	forks_done = DelayUntil(0);
+	if (forks_done >= release)
+	    printf("FORKBENCH> forking took past the release tick, children exited early\n");
+
+	DelayUntil(release);
+	for (i = 0; i < forked; i++) {
+	    if (Wait(&status) == ERROR) {
+		printf("FORKBENCH> Wait failed after %d children!!\n", i);
+		Exit(1);
+	    }
+	}
+	reaped = DelayUntil(0);
+
+	printf("FORKBENCH> %5d children: fork %4d ticks, exit+wait %4d ticks\n",
+	    forked, forks_done - start, reaped - release);
+	if (forked < n) {
+	    printf("FORKBENCH> Fork failed after %d children, stopping\n", forked);
+	    break;
+	}
+	largest = n;
+    }
+    printf("FORKBENCH> largest N that fit in memory: %d\n", largest);
+
+    printf("FORKBENCH> DONE!\n");
+    Exit(0);
+}
@@ -1,6 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <comp421/yalnix.h>
+#include "yalnix.h"
 #include <comp421/hardware.h>
 
 #define MAX_ARGC	32
@@ -20,6 +20,17 @@ StartTerminal(int i)
     cmd_argv[1] = numbuf;
     cmd_argv[2] = NULL;
 
+#ifdef USE_SPAWN	/* needs the Spawn stub in the user library */
+    TracePrintf(0, "Pid %d calling Spawn\n", GetPid());
+    pid = Spawn(cmd_argv[0], cmd_argv);
+    TracePrintf(0, "Pid %d got %d from Spawn\n", GetPid(), pid);
+
+    if (pid < 0) {
+	TtyPrintf(TTY_CONSOLE,
+	    "Cannot Spawn control program for terminal %d.\n", i);
+	return (ERROR);
+    }
+#else
     TracePrintf(0, "Pid %d calling Fork\n", GetPid());
     pid = Fork();
     TracePrintf(0, "Pid %d got %d from Fork\n", GetPid(), pid);
@@ -36,6 +47,7 @@ StartTerminal(int i)
 	    "Cannot Exec control program for terminal %d.\n", i);
 	Exit(1);
     }
+#endif
 
     TtyPrintf(TTY_CONSOLE, "Started pid %d on terminal %d\n", pid, i);
     return (pid);
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include "yalnix.h"
+#include <comp421/hardware.h>
+
+#define SPIN		2000000	/* one chunk of cpu bound work */
+#define MAX_CHUNKS	200
+#define MAX_DELAYS	20
+
+int
+main(int argc, char **argv)
+{
+    int pid;
+    int status;
+    int q, q2;
+    int n;
+    volatile long i;
+
+    setbuf(stdout, NULL);
+
+    printf("QUANTUM> This program tests SetQuantum\n");
+
+    if (SetQuantum(0, -1) != ERROR || SetQuantum(0, 1000) != ERROR) {
+	printf("QUANTUM> bad quantum should have failed!!\n");
+	Exit(1);
+    }
+    if (SetQuantum(12345, 4) != ERROR) {
+	printf("QUANTUM> SetQuantum of a bad pid should have failed!!\n");
+	Exit(1);
+    }
+
+    SetQuantum(0, 3);
+    if ((q = SetQuantum(0, 3)) != 3) {
+	printf("QUANTUM> SetQuantum returned %d, not the old quantum 3!!\n", q);
+	Exit(1);
+    }
+
+    /* a child inherits the quantum of its parent */
+    if ((pid = Fork()) == 0) {
+	Delay(2);
+	Exit(0);
+    }
+    if ((q = SetQuantum(pid, 1)) != 3) {
+	printf("QUANTUM> child started with quantum %d, not 3!!\n", q);
+	Exit(1);
+    }
+    Wait(&status);
+
+    /* adaptive mode: using up whole quanta must make the quantum grow */
+    SetQuantum(0, 0);
+    q = 3;
+    for (n = 0; n < MAX_CHUNKS && q <= 3; n++) {
+	for (i = 0; i < SPIN; i++)
+	    ;
+	q = SetQuantum(0, 0);
+    }
+    printf("QUANTUM> quantum grew from 3 to %d while spinning\n", q);
+    if (q <= 3) {
+	printf("QUANTUM> quantum of a cpu bound process did not grow!!\n");
+	Exit(1);
+    }
+
+    /* and blocking before the quantum is up must make it shrink */
+    q2 = q;
+    for (n = 0; n < MAX_DELAYS && q2 >= q; n++) {
+	Delay(1);
+	q2 = SetQuantum(0, 0);
+    }
+    printf("QUANTUM> quantum shrank from %d to %d while blocking\n", q, q2);
+    if (q2 >= q) {
+	printf("QUANTUM> quantum of a process that blocks early did not shrink!!\n");
+	Exit(1);
+    }
+
+    printf("QUANTUM> DONE!\n");
+    Exit(0);
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include "yalnix.h"
+#include <comp421/hardware.h>
+
+#define PERIOD	5
+#define BUDGET	2
+#define ROUNDS	10
+#define SPIN	20000000
+#define MAX_LAG	1	/* ticks a release may come late while the hog runs */
+
+int
+main(int argc, char **argv)
+{
+    int pid;
+    int status;
+    int next;
+    int now;
+    int i;
+    volatile long j;
+
+    setbuf(stdout, NULL);
+
+    printf("RTTEST> This program tests DelayUntil and SetRealTime\n");
+
+    if (SetRealTime(PERIOD, PERIOD + 1) != ERROR) {
+	printf("RTTEST> budget above period should have failed!!\n");
+	Exit(1);
+    }
+    if (SetRealTime(PERIOD, BUDGET) == ERROR) {
+	printf("RTTEST> SetRealTime failed!!\n");
+	Exit(1);
+    }
+
+    if ((pid = Fork()) == 0) {
+	/* a second reservation of most of the cpu must not be admitted */
+	if (SetRealTime(10, 8) != ERROR) {
+	    printf("RTTEST> over-subscription should have been rejected!!\n");
+	    Exit(1);
+	}
+	/* a CPU hog in the normal class, it must not delay the periodic parent */
+	for (j = 0; j < SPIN; j++)
+	    ;
+	Exit(0);
+    }
+
+    next = DelayUntil(0);
+    for (i = 0; i < ROUNDS; i++) {
+	next += PERIOD;
+	now = DelayUntil(next);
+	printf("RTTEST> round %d released at tick %d, wanted %d\n", i, now, next);
+	if (now < next) {
+	    printf("RTTEST> DelayUntil returned early!!\n");
+	    Exit(1);
+	}
+	if (now > next + MAX_LAG) {
+	    printf("RTTEST> release lagged %d ticks behind the hog!!\n", now - next);
+	    Exit(1);
+	}
+    }
+
+    SetRealTime(0, 0);
+    Wait(&status);
+    if (status != 0) {
+	printf("RTTEST> child failed!!\n");
+	Exit(1);
+    }
+
+    printf("RTTEST> DONE!\n");
+    Exit(0);
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include "yalnix.h"
+#include <comp421/hardware.h>
+
+/*
+ * Run this as init ("yalnix sharestest"), so that each child leads its
+ * own session group.  FAST gets three times the shares of SLOW and
+ * has WORK chunks to do, SLOW only half of that.  With a 3:1 split
+ * SLOW has done a third of WORK when FAST is done, so FAST must exit
+ * first; an even or inverted split lets SLOW finish first.
+ */
+
+#define SPIN	200000	/* one chunk of cpu bound work */
+#define WORK	400
+
+void
+hog(int chunks)
+{
+    int n;
+    volatile long i;
+
+    /* give the parent time to start both children and set the shares */
+    Delay(2);
+    for (n = 0; n < chunks; n++)
+	for (i = 0; i < SPIN; i++)
+	    ;
+    Exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int fast, slow;
+    int first;
+    int status;
+
+    setbuf(stdout, NULL);
+
+    printf("SHARES> This program tests SetShares\n");
+
+    if (SetShares(0, 0) != ERROR || SetShares(0, -5) != ERROR) {
+	printf("SHARES> bad shares should have failed!!\n");
+	Exit(1);
+    }
+    if (SetShares(12345, 100) != ERROR) {
+	printf("SHARES> SetShares of a bad pid should have failed!!\n");
+	Exit(1);
+    }
+
+    if ((fast = Fork()) == 0)
+	hog(WORK);
+    if ((slow = Fork()) == 0)
+	hog(WORK / 2);
+    if (fast == ERROR || slow == ERROR) {
+	printf("SHARES> Fork failed!!\n");
+	Exit(1);
+    }
+    if (SetShares(fast, 300) == ERROR || SetShares(slow, 100) == ERROR) {
+	printf("SHARES> SetShares failed!!\n");
+	Exit(1);
+    }
+
+    first = Wait(&status);
+    Wait(&status);
+    if (first != fast) {
+	printf("SHARES> pid %d with 100 shares finished before pid %d with 300!!\n",
+	    slow, fast);
+	printf("SHARES> (run this program as init)\n");
+	Exit(1);
+    }
+
+    printf("SHARES> DONE!\n");
+    Exit(0);
+}
@@ -3,7 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <comp421/yalnix.h>
+#include "yalnix.h"
 #include <comp421/hardware.h>
 
 main(int argc, char **argv)
@@ -55,6 +55,13 @@ main(int argc, char **argv)
 	j = 1;
 	while ((cmd_argv[j++] = strtok(NULL, separators)) != NULL)
 	    ;
+#ifdef USE_SPAWN	/* needs the Spawn stub in the user library */
+	pid = Spawn(cmd_argv[0], cmd_argv);
+	if (pid < 0) {
+	    TtyPrintf(termno, "Could not Spawn `%s'\n", cmd_argv[0]);
+	    continue;
+	}
+#else
 	pid = Fork();
 	if (pid < 0) {
 	    TtyPrintf(termno, "Cannot Fork process\n");
@@ -66,6 +73,7 @@ main(int argc, char **argv)
 	    TtyPrintf(termno, "Could not Exec `%s'\n", cmd_argv[0]);
 	    Exit(1);
 	}
+#endif
 
 	pid2 = Wait(&status);
 	if (pid2 < 0) {
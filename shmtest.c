@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include "yalnix.h"
+#include <comp421/hardware.h>
+
+#define SHM_ADDR	((int *)(VMEM_0_BASE + VMEM_0_SIZE / 2))
+#define NUM_CHILDREN	3
+
+int
+main(int argc, char **argv)
+{
+    int id;
+    int status;
+    int i;
+    int *shared = SHM_ADDR;
+
+    setbuf(stdout, NULL);
+
+    printf("SHMTEST> This program tests ShmCreate, ShmAttach and ShmDetach\n");
+
+    id = ShmCreate(2 * PAGESIZE);
+    if (id == ERROR) {
+	printf("SHMTEST> ShmCreate failed!!\n");
+	Exit(1);
+    }
+    if (ShmAttach(id, (void *)shared) == ERROR) {
+	printf("SHMTEST> ShmAttach failed!!\n");
+	Exit(1);
+    }
+    if (shared[0] != 0 || shared[PAGESIZE / sizeof(int)] != 0) {
+	printf("SHMTEST> new segment is not zero filled!!\n");
+	Exit(1);
+    }
+    if (ShmAttach(id, (void *)((long)shared + PAGESIZE)) != ERROR) {
+	printf("SHMTEST> overlapping ShmAttach should have failed!!\n");
+	Exit(1);
+    }
+
+    for (i = 0; i < NUM_CHILDREN; i++) {
+	if (Fork() == 0) {
+	    /* the segment stays shared across Fork, no copy-on-write */
+	    shared[i] = GetPid();
+	    shared[PAGESIZE / sizeof(int) + i] = i + 1;
+	    Exit(0);
+	}
+    }
+
+    for (i = 0; i < NUM_CHILDREN; i++) {
+	Wait(&status);
+    }
+
+    for (i = 0; i < NUM_CHILDREN; i++) {
+	printf("SHMTEST> child %d wrote pid %d and %d\n",
+	    i, shared[i], shared[PAGESIZE / sizeof(int) + i]);
+	if (shared[i] <= 0 || shared[PAGESIZE / sizeof(int) + i] != i + 1) {
+	    printf("SHMTEST> write of child %d not seen by parent!!\n", i);
+	    Exit(1);
+	}
+    }
+
+    if (ShmDetach((void *)shared) == ERROR) {
+	printf("SHMTEST> ShmDetach failed!!\n");
+	Exit(1);
+    }
+    if (ShmDetach((void *)shared) != ERROR) {
+	printf("SHMTEST> second ShmDetach should have failed!!\n");
+	Exit(1);
+    }
+
+    printf("SHMTEST> DONE!\n");
+    Exit(0);
+}
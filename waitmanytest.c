@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include "yalnix.h"
+
+#define NUM_CHILDREN	1000
+#define BATCH		256
+
+int pids[NUM_CHILDREN];
+int reaped_pids[BATCH];
+int statuses[BATCH];
+char seen[NUM_CHILDREN];
+
+int
+main(int argc, char **argv)
+{
+    int i, j, n;
+    int forked;
+    int reaped = 0;
+    int calls = 0;
+
+    setbuf(stdout, NULL);
+
+    printf("WAITMANYTEST> This program tests WaitMany\n");
+
+    if (WaitMany(reaped_pids, statuses, BATCH, WAIT_NOHANG) != ERROR) {
+	printf("WAITMANYTEST> WaitMany with no children should have failed!!\n");
+	Exit(1);
+    }
+
+    for (forked = 0; forked < NUM_CHILDREN; forked++) {
+	pids[forked] = Fork();
+	if (pids[forked] == 0)
+	    Exit(forked);
+	if (pids[forked] == ERROR)
+	    break;
+    }
+    printf("WAITMANYTEST> forked %d children\n", forked);
+
+    while (reaped < forked) {
+	n = WaitMany(reaped_pids, statuses, BATCH, 0);
+	calls++;
+	if (n <= 0) {
+	    printf("WAITMANYTEST> WaitMany returned %d after %d children!!\n", n, reaped);
+	    Exit(1);
+	}
+	for (i = 0; i < n; i++) {
+	    j = statuses[i];
+	    if (j < 0 || j >= forked || pids[j] != reaped_pids[i] || seen[j]) {
+		printf("WAITMANYTEST> bad pid %d status %d!!\n", reaped_pids[i], j);
+		Exit(1);
+	    }
+	    seen[j] = 1;
+	}
+	reaped += n;
+    }
+    printf("WAITMANYTEST> reaped %d children in %d calls\n", reaped, calls);
+
+    if (WaitMany(reaped_pids, statuses, BATCH, 0) != ERROR) {
+	printf("WAITMANYTEST> WaitMany with no children left should have failed!!\n");
+	Exit(1);
+    }
+
+    printf("WAITMANYTEST> DONE!\n");
+    Exit(0);
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include "yalnix.h"
+
+#define NUM_CHILDREN	3
+
+int
+main(int argc, char **argv)
+{
+    int pids[NUM_CHILDREN];
+    int status;
+    int i;
+    int pid;
+
+    setbuf(stdout, NULL);
+
+    printf("WAITPIDTEST> This program tests WaitPid\n");
+
+    for (i = 0; i < NUM_CHILDREN; i++) {
+	pids[i] = Fork();
+	if (pids[i] == 0) {
+	    /* later children exit first */
+	    Delay(2 * (NUM_CHILDREN - i));
+	    Exit(i + 1);
+	}
+    }
+
+    pid = WaitPid(pids[0], &status, WAIT_NOHANG);
+    if (pid != 0) {
+	printf("WAITPIDTEST> WAIT_NOHANG returned %d for a running child!!\n", pid);
+	Exit(1);
+    }
+
+    /* reap in fork order, though the children exit in reverse */
+    for (i = 0; i < NUM_CHILDREN; i++) {
+	pid = WaitPid(pids[i], &status, 0);
+	printf("WAITPIDTEST> child pid %d exited with %d\n", pid, status);
+	if (pid != pids[i] || status != i + 1) {
+	    printf("WAITPIDTEST> expected pid %d status %d!!\n", pids[i], i + 1);
+	    Exit(1);
+	}
+    }
+
+    if (WaitPid(pids[0], &status, 0) != ERROR) {
+	printf("WAITPIDTEST> reaped child could be waited for again!!\n");
+	Exit(1);
+    }
+    if (WaitPid(-1, &status, WAIT_NOHANG) != ERROR) {
+	printf("WAITPIDTEST> WaitPid with no children should have failed!!\n");
+	Exit(1);
+    }
+
+    /* the slot of a reaped child gets a new generation */
+    pid = Fork();
+    if (pid == 0)
+	Exit(0);
+    printf("WAITPIDTEST> new child has pid %d\n", pid);
+    for (i = 0; i < NUM_CHILDREN; i++) {
+	if (pid == pids[i]) {
+	    printf("WAITPIDTEST> pid %d was handed out twice!!\n", pid);
+	    Exit(1);
+	}
+    }
+    Wait(&status);
+
+    printf("WAITPIDTEST> DONE!\n");
+    Exit(0);
+}
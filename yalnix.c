@@ -4,9 +4,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <strings.h>
 
 #include <comp421/loadinfo.h>
-#include <comp421/yalnix.h>
+#include "yalnix.h"
 #include <comp421/hardware.h>
 
 #define REGION_0 0
@@ -21,9 +23,76 @@
 
 #define READY_Q NUM_TERMINALS * 2
 #define DELAY_Q READY_Q + 1
+#define DISK_Q DELAY_Q + 1
 
 #define READ_WRITE_PERM PROT_READ|PROT_WRITE
 
+#define MLFQ_LEVELS 4       // priority levels of the ready queue, 0 is the highest
+#define MLFQ_QUANTUM(p) ((p)->quantum << (p)->prio)  // clock ticks p runs at its level before it is preempted
+#define STRIDE_ONE (1 << 20)    // stride of a group with one share
+#define SHARES_DEFAULT 100  // shares of a new group
+#define SHARES_MAX 10000
+#define RT_UTIL_MAX 900     // per mille of the cpu that admitted real-time processes may reserve together
+#define RT_ELIGIBLE(p) ((p)->rt_period > 0 && (p)->rt_used < (p)->rt_budget)   // scheduled by deadline
+#define HANDOFF_PER_TICK 1   // woken processes that may take the cpu from the running one per clock tick
+#define WAKE_LAT_BUCKETS 8  // wakeup to run latencies of 0 .. WAKE_LAT_BUCKETS - 2 ticks, and the rest
+#define QUANTUM_DEFAULT 2   // top level quantum of a process nobody called SetQuantum on
+#define QUANTUM_MIN 1
+#define QUANTUM_MAX 32
+#define QUANTUM_ADAPT_RUNS 2    // adaptive mode doubles or halves the quantum after this many like quanta in a row
+#define MLFQ_AGE_TICKS 10   // period of the aging pass over the lower levels
+#define MLFQ_STARVE_TICKS 20    // a process ready for this long without running moves up one level
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)  // slots per level of the timing wheel
+#define TW_LEVELS 3     // a slot of level l spans TW_SIZE^l ticks, longer delays wait in the last level and cascade again
+
+#define PTE_COW 0x1     // software bit kept in pte.unused: page is shared copy-on-write
+#define PTE_SWAPPED 0x2 // software bit: page is on disk, pfn holds its swap slot
+#define PTE_NOREF 0x4   // software bit: resident page invalidated by the clock hand to catch its next reference
+#define PTE_SHM 0x8     // software bit: page of a shared memory segment, stays shared across Fork
+
+#define SWAP_RESERVE 4      // page faults swap pages out until this many physical pages are free
+#define SWAP_AGE_LOW 16     // the clock hand ages pages on every tick while fewer pages than this are free
+#define SWAP_AGE_BATCH 8    // frames looked at by the clock hand per tick
+#ifdef _LAB3
+#define SECTORS_PER_PAGE (PAGESIZE / SECTORSIZE)
+#define SWAP_SLOTS (NUMSECTORS / SECTORS_PER_PAGE)
+#else
+#define SWAP_SLOTS 0        // no disk without the Lab 3 hardware, pages are never swapped out
+#endif
+
+#define TLB_BATCH_MAX 8     // deferred region 0 flushes beyond this are cheaper as one TLB_FLUSH_0
+
+#define BUDDY_MAX_ORDER 10   // largest free block kept by the frame allocator is 2^BUDDY_MAX_ORDER pages
+#define FRAME_NOT_HEAD 0xff  // frame_order value of frames that do not start a free block
+#define FRAME_FREE(pfn) (frame_free_map[(pfn) >> 3] & (1 << ((pfn) & 7)))
+
+#define PT_PER_PAGE (PAGESIZE / PAGE_TABLE_SIZE)    // page tables that fit in one physical page
+#define PT_ALL_SLOTS ((1 << PT_PER_PAGE) - 1)
+#define PT_ZERO_RESERVE 2    // free zero filled page tables kept ready for Fork
+
+#define STACK_CHUNK_MAX 16   // most pages a single stack fault maps
+#define STACK_FAULT_WINDOW 2 // stack faults closer than this many ticks double the chunk
+#define STACK_RECLAIM_SLACK 2    // pages kept mapped below the saved user sp
+#define STACK_RECLAIM_TICKS 10   // stack reclaim period when memory is not tight
+
+#define IMAGE_CACHE_BUDGET (64 * PAGESIZE)  // bytes of executables the image cache keeps, images in use are never evicted
+#define IMAGE_MAX_SIZE (16 * PAGESIZE)      // larger executables are not cached and are read from the file
+
+#define PID_SLOT_BITS 12
+#define PID_SLOTS (1 << PID_SLOT_BITS)  // processes that can exist at once, counting exited ones not yet reaped
+#define PID_SLOT(pid) ((pid) & (PID_SLOTS - 1))
+#define PID_GEN_MASK ((1 << (31 - PID_SLOT_BITS)) - 1)  // generations wrap before pids turn negative
+
+#define OBJ_CHUNK_SIZE PAGESIZE  // object caches take memory from the kernel heap in chunks of this size
+
+#define ZERO_POOL_MAX 64     // capacity of the pool of pre-zeroed physical pages
+#define ZERO_POOL_BATCH 8    // pages zeroed per clock tick while idle
+
+#define KMAP_SLOTS 8    // number of region 1 pages reserved for mapping physical pages into the kernel
+#define KMAP_BASE (VMEM_1_LIMIT - (2 + KMAP_SLOTS) * PAGESIZE)  // kmap slots sit right below the two page table pages
+
 /* Type definitions */
 typedef void (*trap_handler)(ExceptionStackFrame *frame);   // definition of trap handlers
 
@@ -33,41 +102,162 @@ typedef struct child_exit_info {
     struct child_exit_info *next;
 } cei;
 
+typedef struct text_entry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int npages;
+    int *pfns;      // resident text pages, each holding one reference for the table
+    int nmappers;   // processes currently running this text
+    struct text_entry *next;
+} text_entry;
+
+typedef struct image_entry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t fsize;
+    struct loadinfo li;
+    char *bytes;    // text and data bytes of the executable, li.text_size + li.data_size of them
+    int refs;       // processes that still load pages of their program from this image
+    int stale;      // file changed on the host, no longer found by image_get, freed after the last reference
+    unsigned long last_use;     // image_clock value of the last image_get, for LRU eviction
+    struct image_entry *next;
+} image_entry;
+
+typedef struct kmap_slot {
+    int pfn;        // physical page currently mapped in this slot, -1 if none
+    int pins;       // number of users that still hold the mapping
+    unsigned long last_use;     // kmap_clock value of the last kmap, for LRU eviction
+} kmap_slot;
+
+typedef struct pt_slab {
+    int pfn;        // physical page holding the page tables
+    unsigned int used;      // bit i set when page table i of the page is allocated
+    unsigned int zeroed;    // bit i set when free page table i is known to be zero filled
+    struct pt_slab *next, *prev;    // on pt_slab_head while some page table of the page is free
+} pt_slab;
+
+typedef struct obj_cache {
+    char *name;
+    int size;           // size of one object, at least a pointer
+    void *free_head;    // free objects, linked through their first word
+    int live;           // objects handed out
+    int nfree;          // objects on free_head
+    int high_water;     // most objects live at the same time
+    unsigned long chunks;   // OBJ_CHUNK_SIZE chunks taken from the kernel heap
+} obj_cache;
+
+typedef struct shm_seg {
+    int id;
+    int npages;
+    int *pfns;      // physical pages of the segment, each holding one reference for the segment
+    int refs;       // attachments, plus one while the creating process is alive
+    int creator_pid;    // -1 once the creating process exited
+    struct shm_seg *next;
+} shm_seg;
+
+typedef struct shm_map {
+    shm_seg *seg;
+    int vpn;        // first page the segment is attached at
+    struct shm_map *next;
+} shm_map;
+
+typedef struct sched_group {
+    int id;         // pid of the process that leads the session
+    int shares;     // cpu share of the group relative to the other groups
+    unsigned long stride;   // STRIDE_ONE / shares, added to pass for every tick a member runs
+    unsigned long pass;     // virtual time of the group, the ready group with the lowest pass runs next
+    int nprocs;     // processes in the group
+    unsigned long ticks;    // clock ticks members of the group ran for
+    struct pcb *mlfq_head[MLFQ_LEVELS], *mlfq_tail[MLFQ_LEVELS];  // ready members, one FIFO per level
+    unsigned int mlfq_bitmap;   // bit l set when level l has a ready member
+    struct sched_group *next;
+} sched_group;
+
 typedef struct pcb {
-    SavedContext *ctx;
     void *pt_phys_addr;
     int pid;
     int state; //TERMINATED is -1, RUNNING is 0, READY is 1, WAITBLOCK is 2
     long time_to_switch;
+    struct pcb *tw_next, *tw_prev;  // links of the timing wheel slot, apart from next so a blocked process can also time out
+    int tw_bucket;      // timing wheel slot the process sleeps in, -1 if none
+    sched_group *group; // session the process is scheduled in
+    int prio;           // MLFQ level, lowered when a full quantum is used up, raised by blocking on a terminal or Wait
+    int quantum;        // top level quantum in clock ticks, doubled at each level down
+    int quantum_adaptive;   // 1: quantum follows how the process uses it
+    int quantum_streak;     // adaptive mode: > 0 quanta used up in a row, < 0 quanta given up early in a row
+    int preemptions;    // number of times the clock took the cpu away from the process
+    int wake_pending;   // woken from a terminal or Wait and has not run since
+    unsigned long woken_at;     // sys_time of that wakeup
+    int rt_period;      // real-time class: period in ticks, 0 for a normal process
+    int rt_budget;      // ticks the process may run by deadline in each period
+    int rt_util;        // budget / period in per mille, counted in rt_util_total
+    int rt_used;        // ticks run in the current period
+    unsigned long rt_deadline;  // end of the current period
+    unsigned long ready_since;  // sys_time the process was last put on the ready queue, for aging
     int nchild;
     struct pcb *next;
-    struct pcb *parent;
-    struct pcb *child;
-    struct pcb *sibling;
+    int ppid;   // pid of the parent, -1 if none; the parent is gone once pid_lookup(ppid) fails
+    struct pcb *child_head, *child_tail;    // live children, in fork order
+    struct pcb *sib_prev, *sib_next;    // links in the parent's child list
     cei *exited_children_head;
     cei *exited_children_tail;
     int brk_pn;
     void *stack_allocated_addr;
+    int stack_chunk;    // pages the next stack fault maps, grows while faults come quickly
+    unsigned long stack_fault_time;     // sys_time of the last stack fault
+    int stack_faults;   // number of stack growth faults
+    int stack_reclaimed;    // number of stack pages given back after the stack unwound
+    text_entry *text;   // shared text pages of the running program, NULL if none
+    image_entry *image; // cached executable that text/data pages are loaded from on first touch, NULL if none
+    int exec_fd;        // executable kept open to load text/data pages on first touch when it is not cached, -1 if none
+    long exec_offset;   // file offset of the first text byte in the executable
+    int exec_pending;   // text/data pages not loaded yet, the image or file is let go when it drops to 0
+    unsigned long exec_size;    // number of text and data bytes that come from the file
+    int exec_text_npg;  // number of text pages of the program
+    int exec_npg;       // number of text, data and bss pages of the program
+    shm_map *shm_maps;  // shared memory segments attached between heap and stack
+    SavedContext ctx;   // kept last, the first word of a free pcb links pcb_cache
 } pcb;
 
+typedef struct pid_entry {
+    pcb *proc;      // NULL while the slot is free or its process exited and waits to be reaped
+    int gen;        // generation of the slot, bumped when its pid is released; pid = gen << PID_SLOT_BITS | slot
+    int used;       // pid of the slot is given out
+    int next_free;  // next slot on the free list, -1 at its tail
+} pid_entry;
+
 typedef struct line {
-    void *buf;
+    struct line *next;
     int cur;
     int len;
-    struct line *next;
+    char buf[TERMINAL_MAX_LINE];
 } line;
 
+/* Kernel Object Caches */
+void *obj_alloc(obj_cache *cache);  // take a zero filled object from cache
+void obj_free(obj_cache *cache, void *obj); // give an object back to its cache
+
 /* Kernel Start Methods */
 void init_terminals();
 void init_interrupt_vector_table();
 void init_initial_page_tables();
+void init_frame_table();
 void init_free_page_list();
 void enable_VM();
 
 /* utils */
 void print_pt();    // print current valid ptes
+void print_stats(); // print kernel counters before halting
 void *v2p(void *vaddr); // Given a virtual address, return its physical address
 int copy_page(int vpn, void *physical_pt);  // copy a page of vpn to physical_pt
+int share_pages(void *physical_pt);     // share all user pages of current process with physical_pt copy-on-write
+int cow_break(int vpn);     // give current process a private writable copy of a copy-on-write page
+int fault_in_page(int vpn, int prot);   // make a lazily allocated or copy-on-write user page accessible
+int load_image_page(int vpn);   // fill a text/data/bss page of current process from its executable
 
 /* Program/process Related Methods */
 int load_program_from_file(char *names, char **args);
@@ -75,17 +265,83 @@ int LoadProgram(char *name, char **args, int *brk_pn);   // from load template
 pcb *init_pcb(void *pt_addr, int pid, int is_init_proc);    // initialize pcb
 pcb *get_next_proc_on_queue(int whichQ);    // gets next process on specified queue (ready_q/delay_q/terminal)
 void add_next_proc_on_queue(int whichQ, pcb *toadd); // adds input pcb to specified queue (ready_q/delay_q/terminal)
+void schedule();    // give the cpu to the next ready process, keeping it if that is current process
+void ready_enqueue(pcb *p, int front);  // put p on the ready queue, at the head of its level if front
+void wake_up(pcb *p, int may_switch);   // make blocked p ready, handing it the cpu in handoff mode
+void mlfq_boost(pcb *p);    // current process blocks on a terminal or in Wait, move it to the top level
+void mlfq_age();    // move processes starved on the lower levels up one level
+void mlfq_append(sched_group *g, pcb *p);   // put p at the tail of its level in g
+void rt_replenish(pcb *p);  // start the next period of p once its deadline has passed
+void rt_release(pcb *p, unsigned long wake);    // p sleeps until tick wake, a new period starts then if the last one is over
+sched_group *stride_pick();     // ready group furthest behind its share
+int stride_preempts(pcb *p);    // whether a ready process should take the cpu from running p
+sched_group *group_join(pcb *p);    // group of a new process: init's children lead their own sessions
+void group_leave(sched_group *g);   // a member was torn down, free the group after the last one
+void quantum_adapt(pcb *p, int used_up);  // adaptive mode: p used up its quantum or gave the cpu up early
+void init_pid_table();
+int pid_alloc();    // take the oldest free pid slot, ERROR if all are in use
+pcb *pid_lookup(int pid);   // pcb of a live process, NULL if none
+void pid_release(int pid);  // pid was reaped or nobody will reap it, its slot may be used again
+void child_link(pcb *parent, pcb *child);
+void child_unlink(pcb *parent, pcb *child);
+void tw_insert(pcb *p);     // put p on the timing wheel to wake at p->time_to_switch
+int tw_cancel(pcb *p);      // take p off the timing wheel before it wakes, 1 if it was on it
+void tw_advance(unsigned long now); // wake every process due up to tick now
+void tw_run_bucket(int bucket);
+void tw_unlink(pcb *p);
+text_entry *acquire_shared_text(char *name, struct stat *st, int npages);    // find resident text of an executable
+text_entry *add_shared_text(char *name, struct stat *st, int npages);    // create an entry for current process's text
+void publish_text_pages(text_entry *entry);     // record text pages of current process that entry is missing
+void release_shared_text(text_entry *entry);    // drop a mapper, freeing the text pages after the last one
+image_entry *image_get(char *name, struct stat *st, struct loadinfo *li, int *fd);   // find or read an executable
+void image_put(image_entry *entry);     // drop a reference taken by image_get
+void image_trim();      // evict least recently used images nobody references until the cache fits its budget
+void image_free(image_entry *entry);
+void exec_pages_loaded(int npages);     // npages of the program of current process no longer need the image or file
 
 /* Memory Management Util Methods */
 void free_page_enq(int isregion1, int vpn); // Add a physical page corresponding to vpn to free page list
+void free_frame(int pfn);   // drop a reference to a physical page that is not mapped by current page tables
 int free_page_deq(int isregion1, int vpn, int kprot, int uprot); // Assign a physical page to input vpn's pte entry
 void set_pte(int isregion1, int vpn, int kprot, int uprot, int pfn);  
 void clear_pte(int isregion1, int vpn);
-void *allocate_physical_pt();   // allocate a new page table
-void add_half_free_pt(void *physical_pt);   // add a page table (which occupies a half page) to available half page table linked list
-int read_from_pfn(void *physical_addr); // read the next available pfn from current pfn linkedlist head
-void write_to_pfn(void *physical_addr, int towrite);    // write next available pfn to current pfn linkedlist head
+void tlb_flush_page(int isregion1, int vpn);    // flush one page now, or record it when a batch is open
+void tlb_batch_begin();     // start deferring region 0 flushes
+void tlb_batch_end();       // issue the flushes deferred since the matching tlb_batch_begin
+void *allocate_physical_pt();   // allocate a new zero filled page table
+void free_physical_pt(void *physical_pt);   // give back a page table, freeing its page once all tables in it are free
+pt_slab *new_pt_slab();     // take a zero filled page and add its page tables to the slab
+void refill_pt_reserve(int budget);     // zero free page tables until PT_ZERO_RESERVE of them are ready
+void buddy_mark(int pfn, int order, int isfree);    // set or clear the free bits of a block
+void buddy_insert(int pfn, int order);  // put a free block on the list of its order
+void buddy_remove(int pfn, int order);  // take a free block off the list of its order
+void buddy_free_range(int start, int end);  // free pfns [start, end) as maximal aligned blocks
+void buddy_free_block(int pfn, int order);  // free a block, merging it with its free buddies
+int buddy_alloc_block(int order);   // allocate a block of 2^order pages, splitting larger ones
+int alloc_frames(int npages);   // allocate npages physically contiguous pages
 void validate_region_0_pt();   // set valid bit of region_0_pt pte to 1
+int alloc_frame();  // take a physical page off free page list without mapping it anywhere
+int alloc_zeroed_frame();   // take a zero filled physical page, from the zero pool if possible
+int map_zeroed_page(int vpn, int kprot, int uprot); // map a zero filled physical page at region 0 vpn
+void refill_zero_pool(int budget);  // zero up to budget free pages into the zero pool
+void *kmap(int pfn);    // map physical page pfn into a kernel slot and pin it
+void kunmap(void *vaddr);   // unpin the kernel slot holding vaddr, the mapping stays cached
+void release_user_page(int vpn);    // give back a user page of current process, resident or swapped out
+shm_seg *shm_lookup(int id);    // find a shared memory segment by id
+void shm_put(shm_seg *seg);     // drop a reference to a segment, freeing it after the last one
+void shm_unmap(shm_map *map);   // unmap a segment from current process
+void shm_detach_all();      // unmap every segment attached by current process
+int shm_overlaps(int start, int end);   // whether a segment of current process lies in pages [start, end)
+int grow_stack(void *addr);     // map stack pages down to addr, and a few more if the stack grows quickly
+void reclaim_stack(void *sp);   // give back stack pages of current process well below its user sp
+struct pte *swappable_pte(int pfn, int nrefs, void **page);  // pte of a private user page that may be swapped out
+void swap_age_pages(int nframes);   // let the clock hand invalidate referenced pages to catch their next use
+int swap_out_one();     // write one unreferenced page of another process to disk and free it
+int swap_in(int vpn);   // read swapped out page vpn of current process back
+void reclaim_frames();  // swap pages out until SWAP_RESERVE physical pages are free
+int swap_slot_get();    // allocate a swap slot
+void swap_slot_put(int slot);   // drop a reference to a swap slot
+int swap_page_io(int op, int slot, int pfn);    // read or write physical page pfn from or to a swap slot
 
 /* Trap Handlers*/
 void trap_kernel_handler(ExceptionStackFrame *frame);
@@ -95,22 +351,36 @@ void trap_memory_handler(ExceptionStackFrame *frame);
 void trap_math_handler(ExceptionStackFrame *frame);
 void trap_tty_receive_handler(ExceptionStackFrame *frame);
 void trap_tty_transmit_handler(ExceptionStackFrame *frame);
+void trap_disk_handler(ExceptionStackFrame *frame);
 
 /* Kernel Calls */
 extern int Fork(void);
 extern int Exec(char *, char **);
 extern void Exit(int) __attribute__ ((noreturn));
 extern int Wait(int *);
+extern int WaitPid(int pid, int *status_ptr, int flags);
+extern int WaitMany(int *pids_out, int *statuses_out, int max, int flags);
 extern int GetPid(void);
 extern int Brk(void *);
 extern int Delay(int clock_ticks);
+extern int DelayUntil(int abs_tick);
+extern int SetRealTime(int period, int budget);
+extern int Yield(void);
 extern int TtyRead(int, void *, int);
 extern int TtyWrite(int, void *, int);
+extern int ShmCreate(int size);
+extern int ShmAttach(int id, void *addr);
+extern int ShmDetach(void *addr);
+extern int Spawn(char *filename, char **argvec);
+extern int SetQuantum(int pid, int ticks);
+extern int SetShares(int pid, int shares);
 
 /* Util Input Parameter Check Methods */
 int check_buffer(void *buf, int len, int prot);
 int check_string(char *string, int prot);
 int check_arg(char **arg);
+int copy_exec_args(char *filename, char **argvec, char **filename_out, char ***argvec_out);  // copy Exec arguments into kernel heap
+void free_exec_args(char *filename, char **argvec);
 
 /* Switch Function*/
 SavedContext *MySwitchFunc(SavedContext *ctxp, void *p1, void *p2);
@@ -120,17 +390,84 @@ void *kernel_break = 0; // brk address of kernel
 void *pmem_limit = 0;   // the limit of physical address, will be assigned by KernelStart
 int num_free_pages = 0;
 int vm_enabled = 0; // whether virtual address is enabled
-int free_page_head = -1;    // the pfn of the head of free page linked list
-int next_pid = 0;   // next pid to use
-int upper_next_pt_pfn = -1, lower_next_pt_pfn = -1;     // upper & lower half empty page table linked list
+unsigned short *frame_refcnt = NULL;    // number of ptes mapping each physical page, indexed by pfn
+int num_frames = 0;     // number of physical pages
+unsigned char *frame_free_map = NULL;   // bitmap, bit set when the physical page is free
+unsigned char *frame_order = NULL;      // order of the free block starting at each pfn, FRAME_NOT_HEAD otherwise
+int *buddy_next = NULL, *buddy_prev = NULL;     // links of the free block lists, indexed by pfn of block head
+int buddy_head[BUDDY_MAX_ORDER + 1];    // free block list of each order
+int buddy_nblocks[BUDDY_MAX_ORDER + 1]; // length of each free block list
+text_entry *text_table_head = NULL;     // text pages of executables that are resident in memory
+image_entry *image_head = NULL;     // executables read from the host file system, most recent first
+unsigned long image_bytes = 0;      // text and data bytes held by all images
+unsigned long image_clock = 0;
+unsigned long image_hits = 0, image_misses = 0, image_evictions = 0;
+kmap_slot kmap_slots[KMAP_SLOTS];   // kernel mapping window for physical pages
+unsigned long kmap_clock = 0;
+unsigned long kmap_hits = 0, kmap_misses = 0, kmap_evictions = 0;
+int tlb_batch_depth = 0;    // nesting level of open tlb batches
+int tlb_batch_len = 0;      // number of region 0 addresses recorded in tlb_batch_addrs
+int tlb_batch_full = 0;     // more pages changed than tlb_batch_addrs holds, flush whole region 0
+RCS421RegVal tlb_batch_addrs[TLB_BATCH_MAX];
+unsigned long tlb_page_flushes = 0, tlb_region_flushes = 0, tlb_flushes_deferred = 0;
+int zero_pool[ZERO_POOL_MAX];   // pfns of free pages that are already zero filled
+int zero_pool_len = 0;
+int zero_pool_low = 8;      // idle time refilling starts when the pool drops below this
+int zero_pool_high = 32;    // and stops once the pool holds this many pages (at most ZERO_POOL_MAX)
+int zero_pool_refilling = 1;
+unsigned long zero_pool_hits = 0, zero_pool_empty = 0, zero_pool_filled = 0;
+obj_cache pcb_cache = {"pcb", sizeof(pcb), NULL, 0, 0, 0, 0};
+obj_cache cei_cache = {"cei", sizeof(cei), NULL, 0, 0, 0, 0};
+obj_cache line_cache = {"line", sizeof(line), NULL, 0, 0, 0, 0};
+obj_cache shm_map_cache = {"shm_map", sizeof(shm_map), NULL, 0, 0, 0, 0};
+shm_seg *shm_head = NULL;   // shared memory segments
+int next_shm_id = 1;
+pid_entry pid_table[PID_SLOTS];
+int pid_free_head = -1, pid_free_tail = -1;     // free slots, released ones go to the tail so a pid is reused late
+int pids_used = 0;
+unsigned long pids_recycled = 0;
+unsigned long reaped_batched = 0;  // exit statuses collected by WaitMany
+pt_slab *pt_slab_head = NULL;   // pages with at least one free page table
+pt_slab **frame_slab = NULL;    // slab descriptor of each page holding page tables, indexed by pfn
+int pt_live = 0, pt_free = 0, pt_free_zeroed = 0, pt_slab_pages = 0;
+unsigned long pt_pages_returned = 0;
+void **frame_owner = NULL;  // page table mapping each private user page, NULL if not known, indexed by pfn
+int *frame_vpn = NULL;      // vpn the page is mapped at in frame_owner
+unsigned char *swap_refcnt = NULL;  // number of ptes referring to each swap slot
+int num_swap_slots = 0, swap_slots_used = 0, swap_rotor = 0;
+int clock_hand = 0;     // next frame looked at by the clock replacement
+int disk_busy = 0;      // some process holds the disk
+pcb *disk_waiter = NULL;    // process waiting for the disk request in flight
+pcb *disk_head = NULL, *disk_tail = NULL;   // processes waiting to get the disk
+unsigned long disk_waits = 0;   // number of times a process blocked for the disk
+unsigned long swap_outs = 0, swap_ins = 0, swap_aged = 0, swap_soft_faults = 0, swap_aborted = 0;
 unsigned long sys_time = 0;  // system time
 struct pte *region_0_pt, *region_1_pt;  // current in use page tables
 
 ExceptionStackFrame *EXCEPTION_FRAME_ADDR; // current region_0 exception frame address
 
 pcb *running_block = NULL; //when updated, update region_0_pt also!!!
-pcb *ready_head = NULL, *ready_tail = NULL;
-pcb *delay_head = NULL, *delay_tail = NULL; // Delay function should keep this list sorted
+sched_group root_group = {1, SHARES_DEFAULT, STRIDE_ONE / SHARES_DEFAULT};  // idle, init and what init runs itself
+sched_group *group_list = &root_group;  // groups with live members, each with its own MLFQ ready queue
+obj_cache group_cache = {"group", sizeof(sched_group), NULL, 0, 0, 0, 0};
+int sched_nready = 0;   // ready processes in all groups and the real-time queue
+pcb *rt_head = NULL;    // ready real-time processes within their budget, earliest deadline first
+int rt_util_total = 0;  // per mille of the cpu reserved by admitted real-time processes
+unsigned long rt_preemptions = 0, rt_overruns = 0, rt_rejected = 0;
+unsigned long stride_vtime = 0;     // pass of the group picked last, where a group that wakes up starts
+unsigned long mlfq_demotions = 0, mlfq_boosts = 0, mlfq_aged = 0;
+int switch_involuntary = 0;     // set by the clock handler for the switch it starts
+int switch_fork = 0;    // set by Fork for the switch to the child, the parent did not block
+int wake_handoff = 1;   // 1: a process woken by a terminal or child exit runs next, 0: it waits its turn
+int handoff_budget = HANDOFF_PER_TICK;  // handoffs left in this clock tick
+unsigned long handoffs = 0, handoffs_limited = 0;
+unsigned long wake_latency[WAKE_LAT_BUCKETS];   // wakeups by the ticks it took until the process ran
+int fork_child_first = 1;   // 1: Fork hands the cpu to the child right away, 0: the parent keeps running
+unsigned long switches = 0, switches_avoided = 0, yields = 0, pt_remaps_avoided = 0;
+pcb *tw_wheel[TW_LEVELS * TW_SIZE];     // timing wheel of sleeping processes, the delay queue
+unsigned long tw_time = 0;  // tick the wheel has been advanced to
+int tw_count = 0;   // processes on the wheel
+unsigned long tw_expired = 0, tw_cascaded = 0, tw_cancelled = 0;
 pcb **tty_head, **tty_tail; // first NUM_TERMINALS are for receiving; second NUM_TERMINALS are for transmiting
 pcb **tty_transmiting;  // pcbs that are transmitting to terminal (haven't received interrupt)
 pcb *idle_pcb = NULL;
@@ -138,6 +475,7 @@ pcb *idle_pcb = NULL;
 line **line_head, **line_tail;  // input buffers for each terminal
 
 int init_returned = 0;
+int demand_exec = 1;    // 1: Exec loads text/data pages from the file on first touch, 0: Exec reads the whole image
 
 extern void KernelStart(ExceptionStackFrame *frame, unsigned int pmem_size, void *orig_brk, char **cmd_args) {
     EXCEPTION_FRAME_ADDR = frame;
@@ -146,8 +484,12 @@ extern void KernelStart(ExceptionStackFrame *frame, unsigned int pmem_size, void
 
     // initialize terminals
     init_terminals();
+    // make every pid slot free, idle and init get pids 0 and 1
+    init_pid_table();
     // initialize interrupt vector table
     init_interrupt_vector_table();
+    // allocate per physical page bookkeeping, must happen before region 1 is mapped
+    init_frame_table();
     // initialize region 1 & region 0 page table. they are located at the top of region 1
     init_initial_page_tables();
     // make a list of free physical pages
@@ -163,7 +505,7 @@ extern void KernelStart(ExceptionStackFrame *frame, unsigned int pmem_size, void
         return;
     }
 
-    idle_pcb = init_pcb(new_region0, next_pid++, NORMAL_PROC);
+    idle_pcb = init_pcb(new_region0, pid_alloc(), NORMAL_PROC);
 
     if (init_returned) {
         char **args = calloc(1, sizeof(char *));
@@ -173,7 +515,7 @@ extern void KernelStart(ExceptionStackFrame *frame, unsigned int pmem_size, void
         free(args);
     } else {
         init_returned = 1;
-        running_block = init_pcb((void *)(DOWN_TO_PAGE(pmem_limit) - 2 * PAGESIZE), next_pid++, INIT_PROC);
+        running_block = init_pcb((void *)(DOWN_TO_PAGE(pmem_limit) - 2 * PAGESIZE), pid_alloc(), INIT_PROC);
         load_program_from_file(cmd_args[0], cmd_args);
     }
 }
@@ -190,6 +532,10 @@ extern int SetKernelBrk(void *addr) {
     }
     else {
         int i;
+        if (UP_TO_PAGE(addr) > KMAP_BASE) {
+            fprintf(stderr, "[SET_KERNEL_BRK_ERROR] Kernel heap would run into kmap slots.\n");
+            return -1;
+        }
         if (addr > kernel_break) {
             for (i = (UP_TO_PAGE(kernel_break) - VMEM_1_BASE) >> PAGESHIFT; 
                     i <= (DOWN_TO_PAGE(addr) - VMEM_1_BASE) >> PAGESHIFT; i++) {
@@ -244,6 +590,9 @@ void init_interrupt_vector_table() {
     interrupt_vector_table[TRAP_ILLEGAL] = trap_illegal_handler;
     interrupt_vector_table[TRAP_MEMORY] = trap_memory_handler;
     interrupt_vector_table[TRAP_MATH] = trap_math_handler;
+#ifdef _LAB3
+    interrupt_vector_table[TRAP_DISK] = trap_disk_handler;
+#endif
     interrupt_vector_table[TRAP_TTY_RECEIVE] = trap_tty_receive_handler;
     interrupt_vector_table[TRAP_TTY_TRANSMIT] = trap_tty_transmit_handler;
     WriteRegister(REG_VECTOR_BASE, (RCS421RegVal)interrupt_vector_table);
@@ -293,22 +642,60 @@ void init_initial_page_tables() {
     WriteRegister(REG_PTR1, (RCS421RegVal)region_1_pt);
 }
 
-void init_free_page_list() {
-    free_page_head = UP_TO_PAGE(kernel_break) >> PAGESHIFT;
-    int page_itr;
-    for (page_itr = free_page_head; page_itr < ((long)region_0_pt >> PAGESHIFT) - 1; page_itr++) {
-        *(int *)((long)page_itr << PAGESHIFT) = page_itr + 1;
-        num_free_pages++;
+void init_frame_table() {
+    int i;
+    for (i = 0; i < KMAP_SLOTS; i++) {
+        kmap_slots[i].pfn = -1;
+        kmap_slots[i].pins = 0;
+        kmap_slots[i].last_use = 0;
+    }
+    num_frames = (long)pmem_limit >> PAGESHIFT;
+    frame_refcnt = (unsigned short *)calloc(num_frames, sizeof(unsigned short));
+    frame_free_map = (unsigned char *)calloc((num_frames + 7) / 8, sizeof(unsigned char));
+    frame_order = (unsigned char *)malloc(num_frames * sizeof(unsigned char));
+    buddy_next = (int *)malloc(num_frames * sizeof(int));
+    buddy_prev = (int *)malloc(num_frames * sizeof(int));
+    frame_slab = (pt_slab **)calloc(num_frames, sizeof(pt_slab *));
+    frame_owner = (void **)calloc(num_frames, sizeof(void *));
+    frame_vpn = (int *)calloc(num_frames, sizeof(int));
+    num_swap_slots = SWAP_SLOTS;
+    swap_refcnt = (unsigned char *)calloc(num_swap_slots + 1, sizeof(unsigned char));
+    if (frame_refcnt == NULL || frame_free_map == NULL || frame_order == NULL || buddy_next == NULL || buddy_prev == NULL || frame_slab == NULL
+            || frame_owner == NULL || frame_vpn == NULL || swap_refcnt == NULL) {
+        fprintf(stderr, "[KERNEL_START_ERROR] Not enough memory to initialize frame table.\n");
+        return;
     }
-    *(int *)((long)page_itr << PAGESHIFT) = MEM_INVALID_PAGES;  // link upper freelist to bottom free pages
-    num_free_pages++;
-    for (page_itr = MEM_INVALID_PAGES; 
-            page_itr < (DOWN_TO_PAGE(KERNEL_STACK_BASE) >> PAGESHIFT); 
-            page_itr++) {
-        if (page_itr != (DOWN_TO_PAGE(KERNEL_STACK_BASE) >> PAGESHIFT) - 1) // last page doesn't have next pointer
-            *(int *)((long)page_itr << PAGESHIFT) = page_itr + 1;
-        num_free_pages++;
+    memset(frame_order, FRAME_NOT_HEAD, num_frames);
+    for (i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        buddy_head[i] = -1;
+        buddy_nblocks[i] = 0;
+    }
+    // the boot region 0 page table becomes init's, give its page a slab so free_physical_pt takes it back
+    pt_slab *slab = (pt_slab *)malloc(sizeof(pt_slab));
+    if (slab == NULL) {
+        fprintf(stderr, "[KERNEL_START_ERROR] Not enough memory to initialize frame table.\n");
+        return;
     }
+    slab->pfn = (DOWN_TO_PAGE(pmem_limit) - 2 * PAGESIZE) >> PAGESHIFT;
+    slab->used = 1;
+    slab->zeroed = 0;
+    slab->prev = slab->next = NULL;
+    pt_slab_head = slab;
+    frame_slab[slab->pfn] = slab;
+    frame_refcnt[slab->pfn] = 1;
+    pt_live = 1;
+    pt_free = PT_PER_PAGE - 1;
+    pt_slab_pages = 1;
+}
+
+/* Hand the free physical pages to the frame allocator, only its own tables are written */
+void init_free_page_list() {
+    int start = UP_TO_PAGE(kernel_break) >> PAGESHIFT, end = (long)region_0_pt >> PAGESHIFT;
+    buddy_free_range(start, end);
+    num_free_pages += end - start;
+    end = DOWN_TO_PAGE(KERNEL_STACK_BASE) >> PAGESHIFT;
+    buddy_free_range(MEM_INVALID_PAGES, end);
+    num_free_pages += end - MEM_INVALID_PAGES;
 }
 
 void enable_VM() {
@@ -323,39 +710,56 @@ void enable_VM() {
 SavedContext *MySwitchFunc(SavedContext *ctxp, void *p1, void *p2) {
     pcb *pp1 = (pcb *)p1;
     pcb *pp2 = (pcb *)p2;
-    if (pp1 == pp2) return pp1->ctx; //initialize SavedContext for currently running process
+    if (pp1 == pp2) return &pp1->ctx; //initialize SavedContext for currently running process
     if (pp2 == NULL) {               //initialize SavedContext and copy kernel stack for a newly created (not running) process
         TracePrintf(0, "[INIT] Initializing process %d\n", pp1->pid);
         int i;
         for (i = 0; i < KERNEL_STACK_PAGES; i++) {
             if (copy_page(PAGE_TABLE_LEN - 1 - i, pp1->pt_phys_addr) == ERROR) break;
         }
-        return pp1->ctx;
+        return &pp1->ctx;
     }
 
     if (pp1->state == PCB_TERMINATED) {
         // free region 0 memory
         int itr;
+        shm_detach_all();
+        shm_seg *seg = shm_head;
+        while (seg != NULL) {   // segments created by the process no longer need to outlive it
+            shm_seg *next = seg->next;
+            if (seg->creator_pid == pp1->pid) {
+                seg->creator_pid = -1;
+                shm_put(seg);
+            }
+            seg = next;
+        }
+        tlb_batch_begin();
         for (itr = MEM_INVALID_PAGES; itr < (VMEM_REGION_SIZE >> PAGESHIFT); itr++) {
-            if (region_0_pt[itr].valid) free_page_enq(REGION_0, itr);
+            release_user_page(itr);
         }
+        tlb_batch_end();
+        release_shared_text(pp1->text);
+        image_put(pp1->image);
+        if (pp1->exec_fd >= 0) close(pp1->exec_fd);
         // free region 0 page table
-        add_half_free_pt(pp1->pt_phys_addr);
-
-        free(pp1->ctx);
+        free_physical_pt(pp1->pt_phys_addr);
 
         // free child exit infos
         cei* current = pp1->exited_children_head;
         while (current != NULL) {
             cei* next = current->next;
-            free(current);
+            pid_release(current->pid);  // nobody is left to reap it
+            obj_free(&cei_cache, current);
             current = next;
         }
-        // free pcb
-        free(pp1);
+        // free pcb, its pid stays reserved until the parent reaps it
+        pid_table[PID_SLOT(pp1->pid)].proc = NULL;
+        if (pid_lookup(pp1->ppid) == NULL) pid_release(pp1->pid);     // orphan, nobody will reap it
+        group_leave(pp1->group);
+        obj_free(&pcb_cache, pp1);
 
         // check if no process waiting/running in Yalnix
-        if (pp2 == idle_pcb && ready_head == NULL && delay_head == NULL) {
+        if (pp2 == idle_pcb && sched_nready == 0 && tw_count == 0 && disk_waiter == NULL && disk_head == NULL) {
             int halt = 1;
             int i;
             for (i = 0; i < NUM_TERMINALS; i++) {
@@ -364,47 +768,69 @@ SavedContext *MySwitchFunc(SavedContext *ctxp, void *p1, void *p2) {
                     break;
                 }
             }
-            if (halt) Halt();
+            if (halt) {
+                print_stats();
+                Halt();
+            }
         }
     }
+    else if (switch_involuntary) {
+        if (pp1 != idle_pcb) pp1->preemptions++;   // counted here, schedule() may let it keep the cpu instead
+    }
+    else if (pp1 != idle_pcb && !switch_fork && pp1->time_to_switch > sys_time)
+        quantum_adapt(pp1, 0);  // blocked before its quantum was up
+    switch_involuntary = 0;
+    switch_fork = 0;
+    switches++;
+    if (pp2->wake_pending) {
+        unsigned long latency = sys_time - pp2->woken_at;
+        wake_latency[latency < WAKE_LAT_BUCKETS - 1 ? latency : WAKE_LAT_BUCKETS - 1]++;
+        pp2->wake_pending = 0;
+    }
     TracePrintf(0, "[CONTEXT_SWITCH] Context switch from %d to %d\n", pp1->pid, pp2->pid);
     WriteRegister(REG_PTR0, (RCS421RegVal)((long)(pp2->pt_phys_addr)));
     running_block = pp2;
-    running_block->time_to_switch = sys_time + 2;
+    running_block->time_to_switch = sys_time + MLFQ_QUANTUM(pp2);
     validate_region_0_pt();
     WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_0);
-    return pp2->ctx;
+    return &pp2->ctx;
 }
 
 /*************************** Process/program Related Methods ***************************/
 /* Initialize a new pcb */
 pcb *init_pcb(void *pt_phys_addr, int pid, int is_init_proc) {
-    pcb *new_process = malloc(sizeof(pcb));
+    pcb *new_process = obj_alloc(&pcb_cache);
     if (new_process == NULL) {
         fprintf(stderr, "[INIT_PCB_ERROR] Faliled malloc pcb for new program\n");
         return NULL;
     }
-    new_process->ctx = calloc(1, sizeof(SavedContext));
-    if (new_process->ctx == NULL) {
-        fprintf(stderr, "[INIT_PCB_ERROR] Failed malloc ctx for new program\n");
-        return NULL;
-    }
     new_process->pt_phys_addr = pt_phys_addr;
     new_process->pid = pid;
     new_process->state = 0;
-    new_process->time_to_switch = sys_time + 2;
+    new_process->prio = 0;
+    new_process->group = group_join(new_process);
+    new_process->quantum = running_block != NULL ? running_block->quantum : QUANTUM_DEFAULT;
+    new_process->quantum_adaptive = running_block != NULL ? running_block->quantum_adaptive : 0;
+    new_process->time_to_switch = sys_time + MLFQ_QUANTUM(new_process);
+    new_process->tw_bucket = -1;
     new_process->next = NULL;
-    new_process->parent = pid>1?running_block:NULL;
-    new_process->child = NULL;
-    new_process->sibling = NULL;
+    new_process->ppid = pid>1?running_block->pid:-1;
+    new_process->child_head = new_process->child_tail = NULL;
+    new_process->sib_prev = new_process->sib_next = NULL;
     new_process->exited_children_head = NULL;
     new_process->exited_children_tail = NULL;
     new_process->nchild = 0;
+    new_process->text = NULL;
+    new_process->image = NULL;
+    new_process->exec_fd = -1;
+    new_process->exec_npg = 0;
+    new_process->stack_chunk = 1;
     if (running_block != NULL) {
         new_process->brk_pn = running_block->brk_pn;
         new_process->stack_allocated_addr = running_block->stack_allocated_addr;
     }
-    ContextSwitch(MySwitchFunc, new_process->ctx, (void *)new_process, is_init_proc ? NULL:(void *)new_process);
+    pid_table[PID_SLOT(pid)].proc = new_process;
+    ContextSwitch(MySwitchFunc, &new_process->ctx, (void *)new_process, is_init_proc ? NULL:(void *)new_process);
     return new_process;
 }
 
@@ -426,6 +852,7 @@ int load_program_from_file(char *names, char **args) {
     }
     running_block->brk_pn = *brk_pn;
     running_block->stack_allocated_addr = EXCEPTION_FRAME_ADDR->sp;
+    running_block->stack_chunk = 1;
     free(brk_pn);
     TracePrintf(0, "[LOAD_PROGRAM_FROM_FILE] Successfully load \" %s \"into kernel\n", names);
     return 0;
@@ -433,71 +860,382 @@ int load_program_from_file(char *names, char **args) {
 
 /* Given the type of the queue, return the next available process pcb */
 pcb *get_next_proc_on_queue(int whichQ) {
-    if (whichQ < 0 || whichQ > DELAY_Q) return NULL;
+    if (whichQ < 0 || whichQ > DISK_Q) return NULL;
     if (whichQ < READY_Q) {
         pcb *to_return = tty_head[whichQ];
         if (tty_head[whichQ] == tty_tail[whichQ]) tty_head[whichQ] = tty_tail[whichQ] = NULL;
         else tty_head[whichQ] = tty_head[whichQ]->next;
         return to_return;
     }
-    else if (whichQ == READY_Q) {
-        pcb *to_return = ready_head;
-        if (ready_head == ready_tail) ready_head = ready_tail = NULL;
-        else ready_head = ready_head->next;
-        return (to_return == NULL)?idle_pcb:to_return;
+    else if (whichQ == READY_Q) {   // earliest deadline, else head of the highest non-empty level of the group furthest behind
+        if (rt_head != NULL) {
+            pcb *to_return = rt_head;
+            rt_head = rt_head->next;
+            sched_nready--;
+            return to_return;
+        }
+        if (sched_nready == 0) return idle_pcb;
+        sched_group *g = stride_pick();
+        stride_vtime = g->pass;
+        int prio = ffs(g->mlfq_bitmap) - 1;
+        pcb *to_return = g->mlfq_head[prio];
+        g->mlfq_head[prio] = to_return->next;
+        if (g->mlfq_head[prio] == NULL) {
+            g->mlfq_tail[prio] = NULL;
+            g->mlfq_bitmap &= ~(1 << prio);
+        }
+        sched_nready--;
+        return to_return;
     }
-    else {
-        pcb *to_return = delay_head;
-        if (delay_head == delay_tail) delay_head = delay_tail = NULL;
-        else delay_head = delay_head->next;
+    else if (whichQ == DISK_Q) {
+        pcb *to_return = disk_head;
+        if (disk_head == disk_tail) disk_head = disk_tail = NULL;
+        else disk_head = disk_head->next;
         return to_return;
     }
+    else {  // sleepers leave the timing wheel through tw_advance
+        return NULL;
+    }
 }
 
 /* Add input pcb to specifed queue */
 void add_next_proc_on_queue(int whichQ, pcb *toadd) {
-    if (whichQ < 0 || whichQ > DELAY_Q) return;
+    if (whichQ < 0 || whichQ > DISK_Q) return;
     toadd->next = NULL;
     if (whichQ < READY_Q) {     // add to terminals
         if (tty_head[whichQ] == NULL) tty_head[whichQ] = toadd;
         else tty_tail[whichQ]->next = toadd;
         tty_tail[whichQ] = toadd;
     }
-    else if (whichQ == READY_Q) {   // add to process ready queue
-        if (ready_head == NULL) ready_head = toadd;
-        else ready_tail->next = toadd;
-        ready_tail = toadd;
+    else if (whichQ == READY_Q) {   // add to the level of its priority in its group
+        ready_enqueue(toadd, 0);
+    }
+    else if (whichQ == DISK_Q) {    // add to processes waiting for the disk
+        if (disk_head == NULL) disk_head = toadd;
+        else disk_tail->next = toadd;
+        disk_tail = toadd;
     }
     else {  // add to delay queue
-        if (delay_head == NULL) delay_head = delay_tail = toadd;
-        else {
-            pcb *current = delay_head;
-            pcb *next = delay_head->next;
-            while (current != NULL) {
-                if (toadd->time_to_switch < current->time_to_switch) {
-                    toadd->next = current;
-                    delay_head = toadd;
-                    return;
-                }
-                else if (next == NULL) {
-                    current->next = toadd;
-                    delay_tail = toadd;
-                    return;
-                }
-                else if (toadd->time_to_switch < next->time_to_switch) {
-                    current->next = toadd;
-                    toadd->next = next;
-                    return;
-                }
-                else {
-                    current = next;
-                    next = next->next;
+        tw_insert(toadd);
+    }
+}
+
+/* Current process is on the ready queue or runnable, when it is also the one picked nothing needs to be saved,
+ * remapped or flushed and it just keeps the cpu with the quantum it has */
+void schedule() {
+    pcb *next = get_next_proc_on_queue(READY_Q);
+    if (next == running_block) {
+        switches_avoided++;
+        switch_involuntary = 0;
+        return;
+    }
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)next);
+}
+
+void mlfq_boost(pcb *p) {
+    if (p->prio == 0) return;
+    p->prio = 0;
+    mlfq_boosts++;
+}
+
+void quantum_adapt(pcb *p, int used_up) {
+    if (!p->quantum_adaptive) return;
+    if (used_up) {
+        p->quantum_streak = p->quantum_streak > 0 ? p->quantum_streak + 1 : 1;
+        if (p->quantum_streak >= QUANTUM_ADAPT_RUNS && p->quantum < QUANTUM_MAX) {
+            p->quantum *= 2;
+            p->quantum_streak = 0;
+        }
+    }
+    else {
+        p->quantum_streak = p->quantum_streak < 0 ? p->quantum_streak - 1 : -1;
+        if (p->quantum_streak <= -QUANTUM_ADAPT_RUNS && p->quantum > QUANTUM_MIN) {
+            p->quantum /= 2;
+            p->quantum_streak = 0;
+        }
+    }
+}
+
+void init_pid_table() {
+    int i;
+    for (i = 0; i < PID_SLOTS; i++) {
+        pid_table[i].next_free = i + 1 < PID_SLOTS ? i + 1 : -1;
+    }
+    pid_free_head = 0;
+    pid_free_tail = PID_SLOTS - 1;
+}
+
+int pid_alloc() {
+    if (pid_free_head < 0) return ERROR;
+    int slot = pid_free_head;
+    pid_free_head = pid_table[slot].next_free;
+    if (pid_free_head < 0) pid_free_tail = -1;
+    pid_table[slot].used = 1;
+    pid_table[slot].proc = NULL;
+    pids_used++;
+    if (pid_table[slot].gen > 0) pids_recycled++;
+    return (pid_table[slot].gen << PID_SLOT_BITS) | slot;
+}
+
+pcb *pid_lookup(int pid) {
+    if (pid < 0) return NULL;
+    pid_entry *entry = &pid_table[PID_SLOT(pid)];
+    if (!entry->used || entry->gen != pid >> PID_SLOT_BITS) return NULL;
+    if (entry->proc == NULL || entry->proc->state == PCB_TERMINATED) return NULL;
+    return entry->proc;
+}
+
+void pid_release(int pid) {
+    int slot = PID_SLOT(pid);
+    pid_entry *entry = &pid_table[slot];
+    if (!entry->used || entry->gen != pid >> PID_SLOT_BITS) return;
+    entry->used = 0;
+    entry->proc = NULL;
+    entry->gen = (entry->gen + 1) & PID_GEN_MASK;
+    entry->next_free = -1;
+    if (pid_free_tail < 0) pid_free_head = slot;
+    else pid_table[pid_free_tail].next_free = slot;
+    pid_free_tail = slot;
+    pids_used--;
+}
+
+void mlfq_age() {
+    sched_group *g;
+    int prio;
+    for (g = group_list; g != NULL; g = g->next) {
+        for (prio = 1; prio < MLFQ_LEVELS; prio++) {
+            pcb *prev = NULL, *p = g->mlfq_head[prio];
+            while (p != NULL) {
+                pcb *next = p->next;
+                if (sys_time - p->ready_since < MLFQ_STARVE_TICKS) {
+                    prev = p;
+                    p = next;
+                    continue;
                 }
+                if (prev == NULL) g->mlfq_head[prio] = next;
+                else prev->next = next;
+                if (g->mlfq_tail[prio] == p) g->mlfq_tail[prio] = prev;
+                if (g->mlfq_head[prio] == NULL) g->mlfq_bitmap &= ~(1 << prio);
+                p->prio = prio - 1;
+                p->ready_since = sys_time;
+                mlfq_append(g, p);
+                mlfq_aged++;
+                p = next;
             }
         }
     }
 }
 
+void ready_enqueue(pcb *p, int front) {
+    if (p == idle_pcb) return;  // idle only runs when every level is empty
+    rt_replenish(p);
+    if (RT_ELIGIBLE(p)) {   // real-time queue, sorted by deadline
+        pcb **link = &rt_head;
+        while (*link != NULL && (*link)->rt_deadline <= p->rt_deadline) link = &(*link)->next;
+        p->next = *link;
+        *link = p;
+        sched_nready++;
+        return;
+    }
+    sched_group *g = p->group;
+    if (g->mlfq_bitmap == 0 && (running_block == NULL || g != running_block->group) && g->pass < stride_vtime)
+        g->pass = stride_vtime;     // the group did not want the cpu for a while, that earns it no credit
+    if (front && g->mlfq_head[p->prio] != NULL) {
+        p->next = g->mlfq_head[p->prio];
+        g->mlfq_head[p->prio] = p;
+    }
+    else mlfq_append(g, p);
+    p->ready_since = sys_time;
+    sched_nready++;
+}
+
+/* In handoff mode a woken process takes the cpu from the running one right away, unless that one is within
+ * its real-time budget, a real-time process is ready, or HANDOFF_PER_TICK handoffs already happened in this
+ * tick, which keeps two processes waking each other from starving the rest. Otherwise it goes to the head of
+ * its level */
+void wake_up(pcb *p, int may_switch) {
+    p->wake_pending = 1;
+    p->woken_at = sys_time;
+    if (!wake_handoff) {
+        ready_enqueue(p, 0);
+        return;
+    }
+    if (may_switch && handoff_budget > 0 && rt_head == NULL && !RT_ELIGIBLE(running_block)) {
+        handoff_budget--;
+        handoffs++;
+        switch_involuntary = 1;
+        add_next_proc_on_queue(READY_Q, running_block);
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)p);
+        return;
+    }
+    if (may_switch) handoffs_limited++;
+    ready_enqueue(p, 1);
+}
+
+void mlfq_append(sched_group *g, pcb *p) {
+    p->next = NULL;
+    if (g->mlfq_head[p->prio] == NULL) g->mlfq_head[p->prio] = p;
+    else g->mlfq_tail[p->prio]->next = p;
+    g->mlfq_tail[p->prio] = p;
+    g->mlfq_bitmap |= 1 << p->prio;
+}
+
+/* Stride scheduling: a group's pass grows by its stride for every tick its members run, so picking the
+ * lowest pass gives each group cpu time in proportion to its shares. There are only a few groups */
+sched_group *stride_pick() {
+    sched_group *g, *best = NULL;
+    for (g = group_list; g != NULL; g = g->next) {
+        if (g->mlfq_bitmap != 0 && (best == NULL || g->pass < best->pass)) best = g;
+    }
+    return best;
+}
+
+/* A ready process on a higher level than p takes the cpu from it right away if it is in the same group,
+ * or in a group that is not ahead of p's group; anything else waits for the end of p's quantum */
+int stride_preempts(pcb *p) {
+    sched_group *g;
+    for (g = group_list; g != NULL; g = g->next) {
+        if (g->mlfq_bitmap == 0 || ffs(g->mlfq_bitmap) - 1 >= p->prio) continue;
+        if (g == p->group || g->pass <= p->group->pass) return 1;
+    }
+    return 0;
+}
+
+void rt_replenish(pcb *p) {
+    if (p->rt_period == 0 || sys_time < p->rt_deadline) return;
+    p->rt_deadline += ((sys_time - p->rt_deadline) / p->rt_period + 1) * p->rt_period;
+    p->rt_used = 0;
+}
+
+void rt_release(pcb *p, unsigned long wake) {
+    if (p->rt_period == 0 || wake < p->rt_deadline) return;
+    p->rt_deadline = wake + p->rt_period;
+    p->rt_used = 0;
+}
+
+sched_group *group_join(pcb *p) {
+    sched_group *g;
+    if (running_block == NULL || running_block == idle_pcb) g = &root_group;
+    else if (running_block->pid != root_group.id) g = running_block->group;
+    else {  // started by init, e.g. a terminal shell: a new session
+        g = obj_alloc(&group_cache);
+        if (g == NULL) g = &root_group;
+        else {
+            g->id = p->pid;
+            g->shares = SHARES_DEFAULT;
+            g->stride = STRIDE_ONE / SHARES_DEFAULT;
+            g->pass = stride_vtime;
+            g->next = group_list;
+            group_list = g;
+        }
+    }
+    g->nprocs++;
+    return g;
+}
+
+void group_leave(sched_group *g) {
+    if (--g->nprocs > 0 || g == &root_group) return;
+    TracePrintf(0, "    group %d with %d shares ran for %lu ticks\n", g->id, g->shares, g->ticks);
+    sched_group **link = &group_list;
+    while (*link != g) link = &(*link)->next;
+    *link = g->next;
+    obj_free(&group_cache, g);
+}
+
+/* Link p into the slot of the lowest level whose span still reaches its wake time: level 0 slots are
+ * single ticks, and a level l slot is spread over the lower levels when the wheel enters its span */
+void tw_insert(pcb *p) {
+    unsigned long expires = p->time_to_switch > tw_time ? p->time_to_switch : tw_time + 1;
+    unsigned long delta = expires - tw_time;
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= 1UL << (TW_BITS * (level + 1))) level++;
+    if (delta >= 1UL << (TW_BITS * TW_LEVELS))     // beyond the wheel, wait in its farthest slot
+        expires = tw_time + (1UL << (TW_BITS * TW_LEVELS)) - 1;
+    int bucket = level * TW_SIZE + ((expires >> (TW_BITS * level)) & (TW_SIZE - 1));
+    p->tw_bucket = bucket;
+    p->tw_prev = NULL;
+    p->tw_next = tw_wheel[bucket];
+    if (p->tw_next != NULL) p->tw_next->tw_prev = p;
+    tw_wheel[bucket] = p;
+    tw_count++;
+}
+
+void tw_unlink(pcb *p) {
+    if (p->tw_prev != NULL) p->tw_prev->tw_next = p->tw_next;
+    else tw_wheel[p->tw_bucket] = p->tw_next;
+    if (p->tw_next != NULL) p->tw_next->tw_prev = p->tw_prev;
+    p->tw_next = p->tw_prev = NULL;
+    p->tw_bucket = -1;
+    tw_count--;
+}
+
+int tw_cancel(pcb *p) {
+    if (p->tw_bucket < 0) return 0;
+    tw_unlink(p);
+    tw_cancelled++;
+    return 1;
+}
+
+/* Empty a slot: processes that are due wake up, the others go back in at a lower level */
+void tw_run_bucket(int bucket) {
+    pcb *p = tw_wheel[bucket];
+    while (p != NULL) {
+        pcb *next = p->tw_next;
+        tw_unlink(p);
+        if (p->time_to_switch <= tw_time) {     // never exact: a tick that was missed still wakes it
+            add_next_proc_on_queue(READY_Q, p);
+            tw_expired++;
+        }
+        else {
+            tw_insert(p);
+            tw_cascaded++;
+        }
+        p = next;
+    }
+}
+
+void tw_advance(unsigned long now) {
+    while (tw_time < now) {
+        tw_time++;
+        int level;
+        for (level = TW_LEVELS - 1; level > 0; level--) {   // entering the span of a higher level slot
+            if ((tw_time & ((1UL << (TW_BITS * level)) - 1)) == 0)
+                tw_run_bucket(level * TW_SIZE + ((tw_time >> (TW_BITS * level)) & (TW_SIZE - 1)));
+        }
+        tw_run_bucket(tw_time & (TW_SIZE - 1));
+    }
+}
+
+/*************************** Kernel Object Caches ***************************/
+/* Take an object from cache, carving a new chunk from the kernel heap when no freed object is left */
+void *obj_alloc(obj_cache *cache) {
+    if (cache->free_head == NULL) {
+        int i, nobjs = OBJ_CHUNK_SIZE / cache->size > 0 ? OBJ_CHUNK_SIZE / cache->size : 1;
+        char *chunk = malloc((long)nobjs * cache->size);
+        if (chunk == NULL) return NULL;
+        for (i = nobjs - 1; i >= 0; i--) {
+            *(void **)(chunk + (long)i * cache->size) = cache->free_head;
+            cache->free_head = chunk + (long)i * cache->size;
+        }
+        cache->nfree += nobjs;
+        cache->chunks++;
+    }
+    void *obj = cache->free_head;
+    cache->free_head = *(void **)obj;
+    cache->nfree--;
+    if (++cache->live > cache->high_water) cache->high_water = cache->live;
+    memset(obj, '\0', cache->size);
+    return obj;
+}
+
+/* Give an object back to its cache, the memory is kept for the next object of the same type */
+void obj_free(obj_cache *cache, void *obj) {
+    *(void **)obj = cache->free_head;
+    cache->free_head = obj;
+    cache->nfree++;
+    cache->live--;
+}
+
 /* Enqueue a new child exit info */
 void enq_cei(pcb *parent, cei *info) {
     if (parent->exited_children_head == NULL) {
@@ -509,48 +1247,244 @@ void enq_cei(pcb *parent, cei *info) {
     }
 }
 
-/* Adjust the order of siblings when a child exits */
-void adjust_siblings(pcb *parent, pcb *exited_child) {
-    pcb *brother = parent->child;
-    if (brother == exited_child) {
-        parent->child = brother->sibling;
-        return;
-    }
+/* Append a new child to the end of the parent's child list */
+void child_link(pcb *parent, pcb *child) {
+    child->sib_prev = parent->child_tail;
+    child->sib_next = NULL;
+    if (parent->child_tail != NULL) parent->child_tail->sib_next = child;
+    else parent->child_head = child;
+    parent->child_tail = child;
+    parent->nchild++;
+}
 
-    while (brother->sibling != exited_child) {
-        brother = brother->sibling;
-    }
-    brother->sibling = exited_child->sibling;
+/* Take an exiting child out of the parent's child list */
+void child_unlink(pcb *parent, pcb *child) {
+    if (child->sib_prev != NULL) child->sib_prev->sib_next = child->sib_next;
+    else parent->child_head = child->sib_next;
+    if (child->sib_next != NULL) child->sib_next->sib_prev = child->sib_prev;
+    else parent->child_tail = child->sib_prev;
+    child->sib_prev = child->sib_next = NULL;
+    parent->nchild--;
 }
 
 /* Terminate the running process by informing its parent and children */
 void terminate_process(int status) {
     running_block->state = PCB_TERMINATED;
+    TracePrintf(0, "    pid %d took %d stack faults, %d stack pages reclaimed\n", running_block->pid,
+        running_block->stack_faults, running_block->stack_reclaimed);
+    TracePrintf(0, "    pid %d was preempted %d times, quantum %d ticks\n", running_block->pid,
+        running_block->preemptions, running_block->quantum);
+    rt_util_total -= running_block->rt_util;
+    running_block->rt_util = running_block->rt_period = 0;
 
     // let parent know the process is being terminated
-    if (running_block->parent != NULL) {
-        cei *info = (cei *) calloc(1, sizeof(cei));
+    pcb *parent = pid_lookup(running_block->ppid);
+    if (parent != NULL) {
+        cei *info = (cei *) obj_alloc(&cei_cache);
         info->pid = running_block->pid;
         info->status = status;
-        running_block->parent->nchild -= 1;
-        enq_cei(running_block->parent, info);
-        adjust_siblings(running_block->parent, running_block);
+        enq_cei(parent, info);
+        child_unlink(parent, running_block);
+
+        if (parent->state == 2) {
+            parent->state = 1;
+            wake_up(parent, 0);  // the exiting process switches away next anyway
+        }
+    }
+    // children are not visited: they find out their parent is gone when pid_lookup of their ppid fails,
+    // the pid of this process is not given out again before they could
+}
+
+/* Find text pages already loaded for the same executable and register current process as a mapper */
+text_entry *acquire_shared_text(char *name, struct stat *st, int npages) {
+    text_entry *entry;
+    for (entry = text_table_head; entry != NULL; entry = entry->next) {
+        if (entry->ino == st->st_ino && entry->dev == st->st_dev && entry->mtime == st->st_mtime
+                && entry->npages == npages && strcmp(entry->path, name) == 0) {
+            entry->nmappers++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Create an empty entry for the text of current process so later Execs of the same file can map its pages */
+text_entry *add_shared_text(char *name, struct stat *st, int npages) {
+    text_entry *entry = malloc(sizeof(text_entry));
+    if (entry == NULL) return NULL;
+    entry->path = malloc(strlen(name) + 1);
+    entry->pfns = malloc(sizeof(int) * npages);
+    if (entry->path == NULL || entry->pfns == NULL) {
+        free(entry->path);
+        free(entry->pfns);
+        free(entry);
+        return NULL;
+    }
+    strcpy(entry->path, name);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtime;
+    entry->npages = npages;
+    entry->nmappers = 1;
+    int i;
+    for (i = 0; i < npages; i++) {
+        entry->pfns[i] = -1;
+    }
+    entry->next = text_table_head;
+    text_table_head = entry;
+    return entry;
+}
+
+/* Record the text pages current process has loaded that are not resident in entry yet */
+void publish_text_pages(text_entry *entry) {
+    int i;
+    for (i = 0; i < entry->npages; i++) {
+        if (entry->pfns[i] != -1 || !region_0_pt[MEM_INVALID_PAGES + i].valid) continue;
+        entry->pfns[i] = region_0_pt[MEM_INVALID_PAGES + i].pfn;
+        frame_refcnt[entry->pfns[i]]++;
+    }
+}
+
+/* One process stopped running this text, free the pages when nobody maps them anymore */
+void release_shared_text(text_entry *entry) {
+    if (entry == NULL || --entry->nmappers > 0) return;
+    text_entry **link = &text_table_head;
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    int i;
+    for (i = 0; i < entry->npages; i++) {
+        if (entry->pfns[i] != -1) free_frame(entry->pfns[i]);
+    }
+    free(entry->pfns);
+    free(entry->path);
+    free(entry);
+}
 
-        if (running_block->parent->state == 2) {
-            running_block->parent->state = 1;
-            add_next_proc_on_queue(READY_Q, running_block->parent);
+/* Find executable name in the image cache, reading its header and text/data bytes from the host file
+ * system on a miss. Entries are keyed by path and the file's identity, size and mtime, so a rebuilt
+ * program is read again. Return the entry with a reference for the caller, with the header in li and the
+ * file's status in st. A program larger than IMAGE_MAX_SIZE, or one there is no kernel heap for, is not
+ * cached: then NULL is returned with the file left open in fd, positioned at the text. On errors NULL is
+ * returned and fd is -1 */
+image_entry *image_get(char *name, struct stat *st, struct loadinfo *li, int *fd) {
+    image_entry **link, *entry;
+    *fd = -1;
+    if (stat(name, st) < 0) {
+        TracePrintf(0, "LoadProgram: can't open file '%s'\n", name);
+        return NULL;
+    }
+    image_clock++;
+    for (link = &image_head; *link != NULL; link = &(*link)->next) {
+        entry = *link;
+        if (strcmp(entry->path, name) != 0) continue;
+        if (entry->ino == st->st_ino && entry->dev == st->st_dev && entry->mtime == st->st_mtime
+                && entry->fsize == st->st_size) {
+            entry->refs++;
+            entry->last_use = image_clock;
+            image_hits++;
+            *li = entry->li;
+            return entry;
         }
+        *link = entry->next;    // program changed on the host, processes running the old one keep it
+        entry->stale = 1;
+        if (entry->refs == 0) image_free(entry);
+        break;
+    }
+    image_misses++;
+    int file = open(name, O_RDONLY);
+    if (file < 0 || fstat(file, st) < 0) {
+        TracePrintf(0, "LoadProgram: can't open file '%s'\n", name);
+        if (file >= 0) close(file);
+        return NULL;
+    }
+    int status = LoadInfo(file, li);
+    TracePrintf(0, "LoadProgram: LoadInfo status %d\n", status);
+    switch (status) {
+        case LI_SUCCESS:
+            break;
+        case LI_FORMAT_ERROR:
+            TracePrintf(0,
+                "LoadProgram: '%s' not in Yalnix format\n", name);
+            close(file);
+            return NULL;
+        case LI_OTHER_ERROR:
+            TracePrintf(0, "LoadProgram: '%s' other error\n", name);
+            close(file);
+            return NULL;
+        default:
+            TracePrintf(0, "LoadProgram: '%s' unknown error\n", name);
+            close(file);
+            return NULL;
+    }
+    *fd = file;
+    unsigned long size = li->text_size + li->data_size;
+    if (size > IMAGE_MAX_SIZE) return NULL;
+    long offset = lseek(file, 0, SEEK_CUR);
+    entry = malloc(sizeof(image_entry));
+    if (entry == NULL) return NULL;
+    entry->path = malloc(strlen(name) + 1);
+    entry->bytes = malloc(size > 0 ? size : 1);
+    if (entry->path == NULL || entry->bytes == NULL || pread(file, entry->bytes, size, offset) != size) {
+        TracePrintf(0, "LoadProgram: not caching '%s'\n", name);
+        free(entry->path);
+        free(entry->bytes);
+        free(entry);
+        return NULL;
     }
-    // let children know the process is exiting
-    if (running_block->child != NULL) {
-        pcb *child = running_block->child;
-        while (child != NULL) {
-            child->parent = NULL;
-            child = child->sibling;
+    close(file);    // everything the kernel needs from the file is in the cache now
+    *fd = -1;
+    strcpy(entry->path, name);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtime;
+    entry->fsize = st->st_size;
+    entry->li = *li;
+    entry->refs = 1;
+    entry->stale = 0;
+    entry->last_use = image_clock;
+    entry->next = image_head;
+    image_head = entry;
+    image_bytes += size;
+    image_trim();
+    return entry;
+}
+
+void image_put(image_entry *entry) {
+    if (entry == NULL || --entry->refs > 0) return;
+    if (entry->stale) image_free(entry);
+    else image_trim();
+}
+
+void image_trim() {
+    while (image_bytes > IMAGE_CACHE_BUDGET) {
+        image_entry **link, **lru = NULL;
+        for (link = &image_head; *link != NULL; link = &(*link)->next) {
+            if ((*link)->refs == 0 && (lru == NULL || (*link)->last_use < (*lru)->last_use)) lru = link;
         }
+        if (lru == NULL) return;    // the rest is in use
+        image_entry *victim = *lru;
+        *lru = victim->next;
+        image_evictions++;
+        image_free(victim);
     }
 }
 
+void image_free(image_entry *entry) {
+    image_bytes -= entry->li.text_size + entry->li.data_size;
+    free(entry->bytes);
+    free(entry->path);
+    free(entry);
+}
+
+void exec_pages_loaded(int npages) {
+    running_block->exec_pending -= npages;
+    if (running_block->exec_pending > 0) return;
+    image_put(running_block->image);    // all of the program is resident, the cached copy need not be pinned
+    running_block->image = NULL;
+    if (running_block->exec_fd >= 0) close(running_block->exec_fd);
+    running_block->exec_fd = -1;
+}
+
 /************************ Trap Handlers *************************/
 void trap_kernel_handler(ExceptionStackFrame *frame){
     TracePrintf(0, "[TRAP_KERNEL] Trapped Kernel Handler, pid %d, Code: \n", running_block->pid);
@@ -576,6 +1510,19 @@ void trap_kernel_handler(ExceptionStackFrame *frame){
             TracePrintf(0, "[GET_PID]\n");
             frame->regs[0] = (unsigned long)GetPid();
             break;
+        case YALNIX_WAIT_PID:
+            TracePrintf(0, "[WAIT_PID]\n");
+            frame->regs[0] = (unsigned long)WaitPid((int)(frame->regs[1]), (int *)(frame->regs[2]), (int)(frame->regs[3]));
+            break;
+        case YALNIX_WAIT_MANY:
+            TracePrintf(0, "[WAIT_MANY]\n");
+            frame->regs[0] = (unsigned long)WaitMany((int *)(frame->regs[1]), (int *)(frame->regs[2]),
+                (int)(frame->regs[3]), (int)(frame->regs[4]));
+            break;
+        case YALNIX_YIELD:
+            TracePrintf(0, "[YIELD]\n");
+            frame->regs[0] = (unsigned long)Yield();
+            break;
         case YALNIX_BRK:
             TracePrintf(0, "[BRK]\n");
             frame->regs[0] = (unsigned long)Brk((void *)(frame->regs[1]));
@@ -592,23 +1539,98 @@ void trap_kernel_handler(ExceptionStackFrame *frame){
             TracePrintf(0, "[TTY_WRITE]\n");
             frame->regs[0] = (unsigned long)TtyWrite((int)(frame->regs[1]), (void *)(frame->regs[2]), (int)(frame->regs[3]));
             break;
+        case YALNIX_SPAWN:
+            TracePrintf(0, "[SPAWN]\n");
+            frame->regs[0] = (unsigned long)Spawn((char *)(frame->regs[1]), (char **)(frame->regs[2]));
+            break;
+        case YALNIX_SET_QUANTUM:
+            TracePrintf(0, "[SET_QUANTUM]\n");
+            frame->regs[0] = (unsigned long)SetQuantum((int)(frame->regs[1]), (int)(frame->regs[2]));
+            break;
+        case YALNIX_SET_SHARES:
+            TracePrintf(0, "[SET_SHARES]\n");
+            frame->regs[0] = (unsigned long)SetShares((int)(frame->regs[1]), (int)(frame->regs[2]));
+            break;
+        case YALNIX_DELAY_UNTIL:
+            TracePrintf(0, "[DELAY_UNTIL]\n");
+            frame->regs[0] = (unsigned long)DelayUntil((int)(frame->regs[1]));
+            break;
+        case YALNIX_SET_REAL_TIME:
+            TracePrintf(0, "[SET_REAL_TIME]\n");
+            frame->regs[0] = (unsigned long)SetRealTime((int)(frame->regs[1]), (int)(frame->regs[2]));
+            break;
+        case YALNIX_SHM_CREATE:
+            TracePrintf(0, "[SHM_CREATE]\n");
+            frame->regs[0] = (unsigned long)ShmCreate((int)(frame->regs[1]));
+            break;
+        case YALNIX_SHM_ATTACH:
+            TracePrintf(0, "[SHM_ATTACH]\n");
+            frame->regs[0] = (unsigned long)ShmAttach((int)(frame->regs[1]), (void *)(frame->regs[2]));
+            break;
+        case YALNIX_SHM_DETACH:
+            TracePrintf(0, "[SHM_DETACH]\n");
+            frame->regs[0] = (unsigned long)ShmDetach((void *)(frame->regs[1]));
+            break;
     }
 }
 
 void trap_clock_handler(ExceptionStackFrame *frame){
     TracePrintf(0, "[TRAP_CLOCK] Trapped Clock\n");
     sys_time++;
+    handoff_budget = HANDOFF_PER_TICK;
     TracePrintf(0, "    Current system time is %lu\n", sys_time);
-    while (delay_head != NULL && delay_head->time_to_switch == sys_time) {
-        add_next_proc_on_queue(READY_Q, get_next_proc_on_queue(DELAY_Q));
+    if (running_block == idle_pcb) {
+        refill_pt_reserve(PT_ZERO_RESERVE);
+        refill_zero_pool(ZERO_POOL_BATCH);
+    }
+    if (num_swap_slots > 0 && num_free_pages + zero_pool_len < SWAP_AGE_LOW) swap_age_pages(SWAP_AGE_BATCH);
+    if (running_block != idle_pcb && (sys_time % STACK_RECLAIM_TICKS == 0 || num_free_pages + zero_pool_len < SWAP_AGE_LOW))
+        reclaim_stack(frame->sp);   // clock interrupts only come from user mode, frame->sp is the user sp
+    tw_advance(sys_time);
+    if (sys_time % MLFQ_AGE_TICKS == 0) mlfq_age();
+    if (running_block != idle_pcb) {    // charge the tick to the group
+        running_block->group->pass += running_block->group->stride;
+        running_block->group->ticks++;
+    }
+    int rt = running_block != idle_pcb && RT_ELIGIBLE(running_block);
+    if (rt) running_block->rt_used++;
+    if (running_block != idle_pcb) rt_replenish(running_block);
+    if (rt) {   // runs until it blocks, spends its budget or a process with an earlier deadline is ready
+        if (rt_head != NULL && (!RT_ELIGIBLE(running_block) || rt_head->rt_deadline < running_block->rt_deadline)) {
+            TracePrintf(0, "    Pid %d preempted by an earlier deadline\n", running_block->pid);
+            rt_preemptions++;
+        }
+        else if (!RT_ELIGIBLE(running_block)) {     // the rest of the period it runs as a normal process
+            rt_overruns++;
+            running_block->time_to_switch = sys_time + MLFQ_QUANTUM(running_block);
+            if (sched_nready == 0) return;
+        }
+        else return;
+        switch_involuntary = 1;
+        add_next_proc_on_queue(READY_Q, running_block);
+        schedule();
     }
-    if (running_block == idle_pcb || running_block->time_to_switch == sys_time) {
-        if (ready_head != NULL) {
+    else if (running_block != idle_pcb && running_block->time_to_switch <= sys_time) {
+        // used up its quantum, a longer one follows at the next level down
+        if (running_block->prio < MLFQ_LEVELS - 1) {
+            running_block->prio++;
+            mlfq_demotions++;
+        }
+        quantum_adapt(running_block, 1);
+        running_block->time_to_switch = sys_time + MLFQ_QUANTUM(running_block);
+        if (sched_nready != 0) {
             TracePrintf(0, "    It's context switch time for pid %d\n", running_block->pid);
+            switch_involuntary = 1;
             add_next_proc_on_queue(READY_Q, running_block);
-            ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+            schedule();
         }
     }
+    else if (sched_nready != 0 && (running_block == idle_pcb || rt_head != NULL || stride_preempts(running_block))) {
+        TracePrintf(0, "    Pid %d preempted by a higher level\n", running_block->pid);
+        switch_involuntary = 1;
+        add_next_proc_on_queue(READY_Q, running_block);
+        schedule();
+    }
 }
 
 void trap_illegal_handler(ExceptionStackFrame *frame){
@@ -664,7 +1686,7 @@ void trap_illegal_handler(ExceptionStackFrame *frame){
     fprintf(stderr, error_msg);
     terminate_process(ERROR);
     pcb *next_proc = get_next_proc_on_queue(READY_Q);
-    ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *) next_proc);
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *) next_proc);
 }
 
 void trap_memory_handler(ExceptionStackFrame *frame){
@@ -680,22 +1702,34 @@ void trap_memory_handler(ExceptionStackFrame *frame){
                 reason = "user process attempted to reference kernel address at ";
             } else if (((long)addr >> PAGESHIFT) < MEM_INVALID_PAGES){
                 reason = "user process attempted to reference an address in invalid pages at ";
+            } else if (region_0_pt[(long)addr >> PAGESHIFT].unused & (PTE_NOREF | PTE_SWAPPED)) {
+                // page was taken away by the clock hand
+                if (fault_in_page((long)addr >> PAGESHIFT, PROT_READ) == 0) term_proc = 0;
+                else reason = "could not bring back the swapped out page at ";
             } else if (addr >= running_block->stack_allocated_addr) {
                 fprintf(stderr, "stack allocated: %p\n", running_block->stack_allocated_addr);
                 reason = "user process attempted to reference unmapped page above user stack at ";
-            } else if ((DOWN_TO_PAGE((long)addr) >> PAGESHIFT) <= running_block->brk_pn) {
+            } else if ((DOWN_TO_PAGE((long)addr) >> PAGESHIFT) < running_block->brk_pn) {
+                // program image and heap pages below brk are only given physical memory when first touched
+                if (fault_in_page((long)addr >> PAGESHIFT, PROT_READ) == 0) term_proc = 0;
+                else reason = "could not bring in the page at ";
+            } else if ((DOWN_TO_PAGE((long)addr) >> PAGESHIFT) == running_block->brk_pn) {
                 reason = "user process attempted to reference a red zone address between user stack and user heap at  ";
             } else {
-                term_proc = 0;
-                int itr;
-                for (itr = DOWN_TO_PAGE((long)addr) >> PAGESHIFT; itr < DOWN_TO_PAGE((long)running_block->stack_allocated_addr) >> PAGESHIFT; itr++) {
-                    free_page_deq(REGION_0, itr, READ_WRITE_PERM, READ_WRITE_PERM);
-                }
-                TracePrintf(0, "    User stack break updated from %p to %p, %d pages are added\n", running_block->stack_allocated_addr, addr, itr - (int)(DOWN_TO_PAGE((long)addr) >> PAGESHIFT));
-                running_block->stack_allocated_addr = addr;
+                if (grow_stack(addr) == 0) term_proc = 0;
+                else reason = "no physical page left to grow the user stack to ";
             }
             break;
         case TRAP_MEMORY_ACCERR:   /* Protection violation at %p */
+            if ((long)addr < VMEM_1_BASE && region_0_pt[(long)addr >> PAGESHIFT].valid
+                    && (region_0_pt[(long)addr >> PAGESHIFT].unused & PTE_COW)) {
+                if (fault_in_page((long)addr >> PAGESHIFT, PROT_WRITE) == 0) {
+                    term_proc = 0;
+                    break;
+                }
+                reason = "no physical page left to copy the copy-on-write page at ";
+                break;
+            }
             reason = "protection is violated at ";
             break;
         case TRAP_MEMORY_KERNEL:   /* Linux kernel sent SIGSEGV at %p */
@@ -711,7 +1745,7 @@ void trap_memory_handler(ExceptionStackFrame *frame){
         fprintf(stderr, error_msg);
         terminate_process(ERROR);
         pcb *next_proc = get_next_proc_on_queue(READY_Q);
-        ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *) next_proc);
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *) next_proc);
     }
 }
 
@@ -756,49 +1790,44 @@ void trap_math_handler(ExceptionStackFrame *frame){
     fprintf(stderr, error_msg);
     terminate_process(ERROR);
     pcb *next_proc = get_next_proc_on_queue(READY_Q);
-    ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *) next_proc);
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *) next_proc);
 }
 
 void trap_tty_receive_handler(ExceptionStackFrame *frame){
     TracePrintf(0, "[TRAP_TTY_RECEIVE] Trapped Tty Receive, pid %d\n", running_block->pid);
     int tty = frame->code;
-    void *buf = malloc(sizeof(char) * TERMINAL_MAX_LINE);
-    if (buf == NULL) {
-        fprintf(stderr, "Malloc error, tty_receiver_handler abort.\n");
-        return;
-    }
-    int len = TtyReceive(tty, buf, TERMINAL_MAX_LINE);
-    
-    line *newline = malloc(sizeof(line));
+    line *newline = obj_alloc(&line_cache);
     if (newline == NULL) {
         fprintf(stderr, "Malloc error, tty_receiver_handler abort.\n");
         return;
     }
-    newline->buf = malloc(sizeof(char) * len);
-    if (newline->buf == NULL) {
-        fprintf(stderr, "Malloc error, tty_receiver_handler abort.\n");
-        return;
-    }
-    memcpy(newline->buf, buf, len);
-    free(buf);
+    newline->len = TtyReceive(tty, newline->buf, TERMINAL_MAX_LINE);
     newline->cur = 0;
-    newline->len = len;
     if (line_head[tty] == NULL) line_head[tty] = newline;
     else line_tail[tty]->next = newline;
     line_tail[tty] = newline;
 
     if (tty_head[tty] != NULL)
-        add_next_proc_on_queue(READY_Q, get_next_proc_on_queue(tty));
+        wake_up(get_next_proc_on_queue(tty), 1);
 }
 
 void trap_tty_transmit_handler(ExceptionStackFrame *frame){
     TracePrintf(0, "[TRAP_TTY_TRANSMIT] Trapped Tty Transmit, pid %d\n", running_block->pid);
     int tty = frame->code;
     if (tty_transmiting[tty] != NULL) {
-        add_next_proc_on_queue(READY_Q, tty_transmiting[tty]);
+        pcb *writer = tty_transmiting[tty];
         tty_transmiting[tty] = NULL;
         if (tty_head[tty + NUM_TERMINALS] != NULL)
-            add_next_proc_on_queue(READY_Q, get_next_proc_on_queue(tty + NUM_TERMINALS));
+            wake_up(get_next_proc_on_queue(tty + NUM_TERMINALS), 0);
+        wake_up(writer, 1);
+    }
+}
+
+void trap_disk_handler(ExceptionStackFrame *frame){
+    TracePrintf(0, "[TRAP_DISK] Trapped Disk, pid %d\n", running_block->pid);
+    if (disk_waiter != NULL) {
+        add_next_proc_on_queue(READY_Q, disk_waiter);
+        disk_waiter = NULL;
     }
 }
 
@@ -806,50 +1835,191 @@ void trap_tty_transmit_handler(ExceptionStackFrame *frame){
 
 extern int Fork() {
     TracePrintf(0, "    [FORK] pid %d\n", running_block->pid);
+    reclaim_frames();   // swap out pages of other processes rather than failing the fork
+    int pid = pid_alloc();
+    if (pid == ERROR) {
+        fprintf(stderr, "   [FORK_ERROR]: no free pid.\n");
+        return ERROR;
+    }
     void *new_region0 = allocate_physical_pt();
     if (new_region0 == NULL) {
         fprintf(stderr, "Error allocate free physical page table\n");
+        pid_release(pid);
+        return ERROR;
+    }
+    // everything that can fail is done before the child exists, so a failure leaves nothing to tear down
+    shm_map *map, *copies = NULL;
+    for (map = running_block->shm_maps; map != NULL; map = map->next) {
+        shm_map *copy = obj_alloc(&shm_map_cache);
+        if (copy == NULL) {
+            while (copies != NULL) {
+                copy = copies->next;
+                obj_free(&shm_map_cache, copies);
+                copies = copy;
+            }
+            free_physical_pt(new_region0);
+            pid_release(pid);
+            return ERROR;
+        }
+        copy->seg = map->seg;
+        copy->vpn = map->vpn;
+        copy->next = copies;
+        copies = copy;
+    }
+    // heap and stack are shared with the child until either one writes
+    if (share_pages(new_region0) == ERROR) {
+        while (copies != NULL) {
+            map = copies->next;
+            obj_free(&shm_map_cache, copies);
+            copies = map;
+        }
+        free_physical_pt(new_region0);
+        pid_release(pid);
         return ERROR;
     }
-    pcb *new_pcb = init_pcb(new_region0, next_pid++, NORMAL_PROC);
+    pcb *new_pcb = init_pcb(new_region0, pid, NORMAL_PROC);
     if (running_block->pid == new_pcb->pid) {
         //child process
         return 0;
     }
     else {
         //parent process
-        int i;
-        for (i = MEM_INVALID_PAGES; i < running_block->brk_pn; i++) {
-            if (copy_page(i, new_pcb->pt_phys_addr) == ERROR) return ERROR;
-        }
-
-        for (i = DOWN_TO_PAGE((long)running_block->stack_allocated_addr) >> PAGESHIFT; i < USER_STACK_LIMIT >> PAGESHIFT; i++) {
-            if (copy_page(i, new_pcb->pt_phys_addr) == ERROR) return ERROR;
+        new_pcb->text = running_block->text;
+        if (new_pcb->text != NULL) new_pcb->text->nmappers++;
+        // pages the parent has not touched yet are still loaded from the executable by the child
+        new_pcb->image = running_block->image;
+        if (new_pcb->image != NULL) new_pcb->image->refs++;
+        new_pcb->exec_fd = running_block->exec_fd >= 0 ? dup(running_block->exec_fd) : -1;
+        new_pcb->exec_offset = running_block->exec_offset;
+        new_pcb->exec_pending = running_block->exec_pending;
+        new_pcb->exec_size = running_block->exec_size;
+        new_pcb->exec_text_npg = running_block->exec_text_npg;
+        new_pcb->exec_npg = running_block->exec_npg;
+        // attached segments stay shared, share_pages mapped their pages without copy-on-write
+        new_pcb->shm_maps = copies;
+        for (map = copies; map != NULL; map = map->next) map->seg->refs++;
+        int child_pid = new_pcb->pid;   // new_pcb may be gone when the parent runs again
+
+        child_link(running_block, new_pcb);
+        if (fork_child_first) {     // most children Exec right away, the parent's pages then stay unshared
+            add_next_proc_on_queue(READY_Q, running_block);
+            switch_fork = 1;
+            ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)new_pcb);
         }
-
-        pcb *child = running_block->child;
-        if (child == NULL) running_block->child = new_pcb;
         else {
-            while (child->sibling != NULL) child = child->sibling;
-            child->sibling = new_pcb;
+            add_next_proc_on_queue(READY_Q, new_pcb);
+            switches_avoided++;
         }
-        running_block->nchild++;
-        add_next_proc_on_queue(READY_Q, new_pcb);
-        add_next_proc_on_queue(READY_Q, running_block);
-        ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
-        return new_pcb->pid;
+        return child_pid;
     }
 }
 
 extern int Exec(char *filename, char **argvec) {
     TracePrintf(0, "    [EXEC] pid %d\n", running_block->pid);
-    //check parameters
-    int name_length = check_string(filename, PROT_READ);
+    char *filename_cp, **argvec_cp;
+    if (copy_exec_args(filename, argvec, &filename_cp, &argvec_cp) < 0) return ERROR;
+
+    int ret;
+    if (load_program_from_file(filename_cp, argvec_cp) < 0) ret = ERROR;
+    else ret = 0;
+
+    free_exec_args(filename_cp, argvec_cp);
+    return ret;
+}
+
+/* Start a child running filename with argvec in a new address space, without copying the memory of
+ * current process. Return the child's pid; if the program cannot be loaded the child exits with ERROR */
+extern int Spawn(char *filename, char **argvec) {
+    TracePrintf(0, "    [SPAWN] pid %d\n", running_block->pid);
+    char *filename_cp, **argvec_cp;
+    if (copy_exec_args(filename, argvec, &filename_cp, &argvec_cp) < 0) return ERROR;
+    struct stat st;
+    struct loadinfo li;
+    int fd;
+    image_entry *image = image_get(filename_cp, &st, &li, &fd);   // catch a bad program before there is a child to report it
+    if (image == NULL && fd < 0) {
+        fprintf(stderr, "   [SPAWN_ERROR]: cannot load %s.\n", filename_cp);
+        free_exec_args(filename_cp, argvec_cp);
+        return ERROR;
+    }
+    image_put(image);   // stays cached for the child
+    if (fd >= 0) close(fd);
+    reclaim_frames();
+    int pid = pid_alloc();
+    if (pid == ERROR) {
+        fprintf(stderr, "   [SPAWN_ERROR]: no free pid.\n");
+        free_exec_args(filename_cp, argvec_cp);
+        return ERROR;
+    }
+    void *new_region0 = allocate_physical_pt();
+    if (new_region0 == NULL) {
+        fprintf(stderr, "Error allocate free physical page table\n");
+        pid_release(pid);
+        free_exec_args(filename_cp, argvec_cp);
+        return ERROR;
+    }
+    pcb *new_pcb = init_pcb(new_region0, pid, NORMAL_PROC);
+    if (running_block->pid == new_pcb->pid) {
+        // child, first run in its empty address space: the copied kernel stack resumes here
+        int res = load_program_from_file(filename_cp, argvec_cp);
+        free_exec_args(filename_cp, argvec_cp);
+        if (res < 0) Exit(ERROR);
+        return 0;
+    }
+    // parent, the child owns filename_cp and argvec_cp now
+    child_link(running_block, new_pcb);
+    add_next_proc_on_queue(READY_Q, new_pcb);
+    return new_pcb->pid;
+}
+
+/* Set the top level quantum of process pid (0 for current process) to ticks, or put it in adaptive
+ * mode if ticks is 0, where the quantum grows while the process uses it up and shrinks while it blocks early.
+ * Return the quantum the process had before the call */
+extern int SetQuantum(int pid, int ticks) {
+    TracePrintf(0, "    [SET_QUANTUM] pid %d sets pid %d to %d ticks\n", running_block->pid, pid, ticks);
+    pcb *p = pid == 0 ? running_block : pid_lookup(pid);
+    if (p == NULL || p == idle_pcb || ticks < 0 || ticks > QUANTUM_MAX) return ERROR;
+    int old = p->quantum;
+    if (ticks == 0) {
+        if (!p->quantum_adaptive) p->quantum_streak = 0;   // an adaptive process keeps adapting
+        p->quantum_adaptive = 1;
+    }
+    else {
+        p->quantum_adaptive = 0;
+        p->quantum = ticks;
+        p->quantum_streak = 0;
+    }
+    return old;
+}
+
+/* Give the session group of process pid (0 for current process) shares of the cpu, relative to the
+ * shares of the other groups */
+extern int SetShares(int pid, int shares) {
+    TracePrintf(0, "    [SET_SHARES] pid %d sets group of pid %d to %d shares\n", running_block->pid, pid, shares);
+    pcb *p = pid == 0 ? running_block : pid_lookup(pid);
+    if (p == NULL || p == idle_pcb || shares <= 0 || shares > SHARES_MAX) return ERROR;
+    p->group->shares = shares;
+    p->group->stride = STRIDE_ONE / shares;
+    return 0;
+}
+
+/* Copy filename and argvec of Exec/Spawn from user memory into kernel heap */
+int copy_exec_args(char *filename, char **argvec, char **filename_out, char ***argvec_out) {
+    //check parameters, again if bringing a page back let other processes swap out pages checked before
+    unsigned long waits;
+    int name_length, arg_length, i;
+    do {
+        waits = disk_waits;
+        name_length = check_string(filename, PROT_READ);
+        arg_length = name_length < 0 ? -1 : check_arg(argvec);
+        for (i = 0; i < arg_length; i++) {
+            if (check_string(argvec[i], READ_WRITE_PERM) < 0) break;
+        }
+    } while (waits != disk_waits);
     if (name_length < 0) {
         fprintf(stderr, "   [EXEC_ERROR]: filename cannot be accessed.\n");
         return ERROR;
     }
-    int arg_length = check_arg(argvec);
     if (arg_length < 0) {
         fprintf(stderr, "   [EXEC_ERROR]: argument list cannot be accessed.\n");
         return ERROR;
@@ -869,7 +2039,6 @@ extern int Exec(char *filename, char **argvec) {
         free(argvec_cp);
         return ERROR;
     }
-    int i;
     for (i = 0; i < arg_length; i++) {
         int len = check_string(argvec[i], READ_WRITE_PERM);
         if (len < 0) {
@@ -895,68 +2064,153 @@ extern int Exec(char *filename, char **argvec) {
     }
     argvec_cp[arg_length] = NULL;
 
-    int ret;
-    if (load_program_from_file(filename_cp, argvec_cp) < 0) ret = ERROR;
-    else ret = 0;
+    *filename_out = filename_cp;
+    *argvec_out = argvec_cp;
+    return 0;
+}
 
-    free(filename_cp);
-    for (i = 0; i < arg_length; i++) {
-        free(argvec_cp[i]);
+void free_exec_args(char *filename, char **argvec) {
+    int i;
+    free(filename);
+    for (i = 0; argvec[i] != NULL; i++) {
+        free(argvec[i]);
     }
-    free(argvec_cp);
-    return ret;
+    free(argvec);
 }
 
 extern void Exit(int status){
     TracePrintf(0, "    [EXIT] pid %d\n", running_block->pid);
     terminate_process(status);
-    ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
     while(1){}
 }
 
 extern int Wait(int *status_ptr) {
     TracePrintf(0, "    [WAIT] pid %d\n", running_block->pid);
-    if (check_buffer((void *)status_ptr, sizeof(int), PROT_WRITE) < 0) {
-        fprintf(stderr, "   [WAIT_ERROR]: status pointer not accessible by kernel.\n");
-        return ERROR;
-    }
-    if (running_block->exited_children_head == NULL) {
+    return WaitPid(-1, status_ptr, 0);
+}
+
+/* Collect the exit status of child pid, or of the child that exited first if pid is -1, and return its pid.
+ * With WAIT_NOHANG in flags, return 0 instead of blocking while the child is still running */
+extern int WaitPid(int pid, int *status_ptr, int flags) {
+    TracePrintf(0, "    [WAIT_PID] pid %d waits for %d\n", running_block->pid, pid);
+    cei **link, *prev;
+    if (pid < -1 || (flags & ~WAIT_NOHANG) != 0) return ERROR;
+    while (1) {     // status_ptr is checked again after blocking, its page may have been swapped out
+        if (check_buffer((void *)status_ptr, sizeof(int), PROT_WRITE) < 0) {
+            fprintf(stderr, "   [WAIT_ERROR]: status pointer not accessible by kernel.\n");
+            return ERROR;
+        }
+        prev = NULL;
+        for (link = &running_block->exited_children_head; *link != NULL; link = &(*link)->next) {
+            if (pid == -1 || (*link)->pid == pid) break;
+            prev = *link;
+        }
+        if (*link != NULL) break;
+        if (pid == -1 ? running_block->nchild == 0
+                : pid_lookup(pid) == NULL || pid_lookup(pid)->ppid != running_block->pid) {
+            fprintf(stderr, "   [WAIT_ERROR]: no such child of current process.\n");
+            return ERROR;
+        }
+        if (flags & WAIT_NOHANG) return 0;
+        running_block->state = 2;
+        mlfq_boost(running_block);
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, get_next_proc_on_queue(READY_Q));
+    }
+    cei *tmp = *link;
+    *link = tmp->next;
+    if (running_block->exited_children_tail == tmp) running_block->exited_children_tail = prev;
+    *status_ptr = tmp->status;
+    int res = tmp->pid;
+    obj_free(&cei_cache, tmp);
+    pid_release(res);
+    return res;
+}
+
+/* Collect up to max exit statuses of children in one call, in the order the children exited, and return
+ * how many were collected. Blocks until at least one child has exited, unless flags has WAIT_NOHANG */
+extern int WaitMany(int *pids_out, int *statuses_out, int max, int flags) {
+    TracePrintf(0, "    [WAIT_MANY] pid %d reaps up to %d\n", running_block->pid, max);
+    if (max <= 0 || (flags & ~WAIT_NOHANG) != 0) return ERROR;
+    if (max > PID_SLOTS) max = PID_SLOTS;   // no process has more exited children than that
+    unsigned long waits;
+    int res;
+    while (1) {     // the arrays are checked again after blocking, their pages may have been swapped out
+        do {    // bringing one array back in may let other processes swap out the other
+            waits = disk_waits;
+            res = check_buffer((void *)pids_out, max * sizeof(int), PROT_WRITE);
+            if (res >= 0) res = check_buffer((void *)statuses_out, max * sizeof(int), PROT_WRITE);
+        } while (waits != disk_waits);
+        if (res < 0) {
+            fprintf(stderr, "   [WAIT_ERROR]: output arrays not accessible by kernel.\n");
+            return ERROR;
+        }
+        if (running_block->exited_children_head != NULL) break;
         if (running_block->nchild == 0) {
             fprintf(stderr, "   [WAIT_ERROR]: no more children of current process.\n");
             return ERROR;
         }
+        if (flags & WAIT_NOHANG) return 0;
         running_block->state = 2;
-        ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, get_next_proc_on_queue(READY_Q));
+        mlfq_boost(running_block);
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, get_next_proc_on_queue(READY_Q));
+    }
+    int n = 0;
+    while (n < max && running_block->exited_children_head != NULL) {
+        cei *tmp = running_block->exited_children_head;
+        running_block->exited_children_head = tmp->next;
+        pids_out[n] = tmp->pid;
+        statuses_out[n] = tmp->status;
+        pid_release(tmp->pid);
+        obj_free(&cei_cache, tmp);
+        n++;
     }
-    *status_ptr = running_block->exited_children_head->status;
-    int res = running_block->exited_children_head->pid;
-    cei* tmp = running_block->exited_children_head;
-    running_block->exited_children_head = running_block->exited_children_head->next;
     if (running_block->exited_children_head == NULL) running_block->exited_children_tail = NULL;
-    free(tmp);
-    return res;
+    reaped_batched += n;
+    return n;
 }
 
 extern int GetPid() {
     return running_block->pid;
 }
 
+/* Let another ready process run. Returns at once when nothing else is ready */
+extern int Yield() {
+    TracePrintf(0, "    [YIELD] pid %d\n", running_block->pid);
+    yields++;
+    if (sched_nready == 0) {
+        switches_avoided++;
+        return 0;
+    }
+    add_next_proc_on_queue(READY_Q, running_block);
+    schedule();
+    return 0;
+}
+
 extern int Brk(void *addr) {
     TracePrintf(0, "    [BRK] pid %d\n", running_block->pid);
     int new_brk = UP_TO_PAGE(addr) >> PAGESHIFT;
     TracePrintf(0, "    Attempting to set old brk %d to new brk %d\n", running_block->brk_pn, new_brk);
     if (new_brk < running_block->brk_pn && new_brk >= MEM_INVALID_PAGES) {  // move brk down
         int itr;
+        tlb_batch_begin();
+        int unloaded = 0;
         for (itr = new_brk; itr < running_block->brk_pn; itr++) {
-            free_page_enq(REGION_0, itr);
+            if (itr - MEM_INVALID_PAGES < running_block->exec_npg && ((long)(itr - MEM_INVALID_PAGES) << PAGESHIFT) < running_block->exec_size
+                    && !region_0_pt[itr].valid && !(region_0_pt[itr].unused & (PTE_SWAPPED | PTE_NOREF)))
+                unloaded++;     // never loaded from the program, now it never will be
+            release_user_page(itr);     // untouched heap pages never got memory
         }
+        tlb_batch_end();
+        if (new_brk - MEM_INVALID_PAGES < running_block->exec_npg)     // pages given back must come back zero filled
+            running_block->exec_npg = new_brk - MEM_INVALID_PAGES;
+        if (unloaded > 0) exec_pages_loaded(unloaded);
         running_block->brk_pn = new_brk;
         return 0;
-    } else if (new_brk >= running_block->brk_pn && new_brk < DOWN_TO_PAGE(running_block->stack_allocated_addr)) { // move brk up
-        int itr;
-        for (itr = running_block->brk_pn; itr < new_brk; itr++) {
-            free_page_deq(REGION_0, itr, READ_WRITE_PERM, READ_WRITE_PERM);
-        }
+    } else if (new_brk >= running_block->brk_pn
+            && new_brk < (DOWN_TO_PAGE(running_block->stack_allocated_addr) >> PAGESHIFT) - 1
+            && !shm_overlaps(running_block->brk_pn, new_brk + 1)) { // move brk up, the red zone must not hit a segment or the stack
+        // the new pages are zero filled by trap_memory_handler when first touched
         running_block->brk_pn = new_brk;
         return 0;
     }
@@ -968,8 +2222,43 @@ extern int Delay(int clock_ticks) {
     if (clock_ticks < 0) return ERROR;
     if (clock_ticks == 0) return 0;
     running_block->time_to_switch = sys_time + clock_ticks;
+    rt_release(running_block, running_block->time_to_switch);
     add_next_proc_on_queue(DELAY_Q, running_block);
-    ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+    return 0;
+}
+
+/* Block current process until clock tick abs_tick. Return the tick it resumes at, so DelayUntil(0) reads
+ * the clock and a loop adding its period to the tick it was released at does not drift */
+extern int DelayUntil(int abs_tick) {
+    TracePrintf(0, "    [DELAY_UNTIL] pid %d\n", running_block->pid);
+    if (abs_tick < 0) return ERROR;
+    if (abs_tick <= sys_time) return (int)sys_time;
+    running_block->time_to_switch = abs_tick;
+    rt_release(running_block, abs_tick);
+    add_next_proc_on_queue(DELAY_Q, running_block);
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+    return (int)sys_time;
+}
+
+/* Put current process in the real-time class: in every period of period ticks it may run budget ticks,
+ * scheduled earliest deadline first ahead of all normal processes. Fails if the reserved share of the cpu
+ * would exceed RT_UTIL_MAX. period 0 returns the process to the normal class */
+extern int SetRealTime(int period, int budget) {
+    TracePrintf(0, "    [SET_REAL_TIME] pid %d period %d budget %d\n", running_block->pid, period, budget);
+    pcb *p = running_block;
+    if (period < 0 || (period > 0 && (budget <= 0 || budget > period))) return ERROR;
+    int util = period == 0 ? 0 : (budget * 1000 + period - 1) / period;
+    if (rt_util_total - p->rt_util + util > RT_UTIL_MAX) {
+        rt_rejected++;
+        return ERROR;
+    }
+    rt_util_total += util - p->rt_util;
+    p->rt_util = util;
+    p->rt_period = period;
+    p->rt_budget = budget;
+    p->rt_used = 0;
+    p->rt_deadline = sys_time + period;
     return 0;
 }
 
@@ -977,14 +2266,16 @@ extern int TtyRead(int tty_id, void *buf, int len) {
     TracePrintf(0, "    [TTY_READ] pid %d\n", running_block->pid);
     if (len < 0) return ERROR;
     if (len == 0) return 0;
-    if (check_buffer(buf, len, PROT_WRITE) < 0) {
-        fprintf(stderr, "   [TTY_READ_ERROR]: buf not valid for kernel to write in.\n");
-        return ERROR;
-    }
-    //check if there is anything ready to read
-    if (line_head[tty_id] == NULL) {
+    while (1) {     // buf is checked again after blocking, its pages may have been swapped out
+        if (check_buffer(buf, len, PROT_WRITE) < 0) {
+            fprintf(stderr, "   [TTY_READ_ERROR]: buf not valid for kernel to write in.\n");
+            return ERROR;
+        }
+        //check if there is anything ready to read
+        if (line_head[tty_id] != NULL) break;
+        mlfq_boost(running_block);
         add_next_proc_on_queue(tty_id, running_block);
-        ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
     }
     //read from buffer
     line *tmp = line_head[tty_id];
@@ -994,8 +2285,7 @@ extern int TtyRead(int tty_id, void *buf, int len) {
         memcpy(buf, (void *)((long)tmp->buf + tmp->cur), res);
         line_head[tty_id] = tmp->next;
         if (line_head[tty_id] == NULL) line_tail[tty_id] = NULL;
-        free(tmp->buf);
-        free(tmp);
+        obj_free(&line_cache, tmp);
         return res;
     }
     else {
@@ -1012,30 +2302,120 @@ extern int TtyWrite(int tty_id, void *buf, int len) {
     TracePrintf(0, "    [TTY_WRITE] pid %d\n", running_block->pid);
     if (len < 0 || len > TERMINAL_MAX_LINE) return ERROR;
     if (len == 0) return 0;
-    if (check_buffer(buf, len, PROT_READ) < 0) {
-        fprintf(stderr, "   [TTY_WRITE_ERROR]: buf not valid for kernel to write to.\n");
-        return ERROR;
-    }
-    //check if some process is transmitting
-    if (tty_transmiting[tty_id] != NULL) {
+    while (1) {     // buf is checked again after blocking, its pages may have been swapped out
+        if (check_buffer(buf, len, PROT_READ) < 0) {
+            fprintf(stderr, "   [TTY_WRITE_ERROR]: buf not valid for kernel to write to.\n");
+            return ERROR;
+        }
+        //check if some process is transmitting
+        if (tty_transmiting[tty_id] == NULL) break;
+        mlfq_boost(running_block);
         add_next_proc_on_queue(tty_id + NUM_TERMINALS, running_block);
-        ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
     }
     tty_transmiting[tty_id] = running_block;
     TtyTransmit(tty_id, buf, len);
-    ContextSwitch(MySwitchFunc, running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+    mlfq_boost(running_block);
+    ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
     return len;
 }
 
+/* Create a shared memory segment of size bytes, zero filled. Return its id */
+extern int ShmCreate(int size) {
+    TracePrintf(0, "    [SHM_CREATE] pid %d\n", running_block->pid);
+    int npages = UP_TO_PAGE(size) >> PAGESHIFT;
+    int i;
+    if (size <= 0) return ERROR;
+    reclaim_frames();
+    if (npages > num_free_pages + zero_pool_len - SWAP_RESERVE) {
+        fprintf(stderr, "   [SHM_CREATE_ERROR]: not enough physical pages for %d bytes.\n", size);
+        return ERROR;
+    }
+    shm_seg *seg = malloc(sizeof(shm_seg));
+    if (seg == NULL) return ERROR;
+    seg->pfns = malloc(sizeof(int) * npages);
+    if (seg->pfns == NULL) {
+        free(seg);
+        return ERROR;
+    }
+    for (i = 0; i < npages; i++) {
+        if ((seg->pfns[i] = alloc_zeroed_frame()) < 0) {
+            while (--i >= 0) free_frame(seg->pfns[i]);
+            free(seg->pfns);
+            free(seg);
+            return ERROR;
+        }
+    }
+    seg->id = next_shm_id++;
+    seg->npages = npages;
+    seg->refs = 1;
+    seg->creator_pid = running_block->pid;
+    seg->next = shm_head;
+    shm_head = seg;
+    return seg->id;
+}
+
+/* Map segment id into current process at page aligned addr, which must lie between the red zones
+ * above the heap and below the stack without overlapping another segment */
+extern int ShmAttach(int id, void *addr) {
+    TracePrintf(0, "    [SHM_ATTACH] pid %d\n", running_block->pid);
+    shm_seg *seg = shm_lookup(id);
+    int vpn = (long)addr >> PAGESHIFT;
+    int i;
+    if (seg == NULL || (long)addr % PAGESIZE != 0 || (long)addr < 0) {
+        fprintf(stderr, "   [SHM_ATTACH_ERROR]: no segment %d or address %p not page aligned.\n", id, addr);
+        return ERROR;
+    }
+    if (vpn <= running_block->brk_pn || vpn + seg->npages >= (DOWN_TO_PAGE(running_block->stack_allocated_addr) >> PAGESHIFT)
+            || shm_overlaps(vpn - 1, vpn + seg->npages + 1)) {
+        fprintf(stderr, "   [SHM_ATTACH_ERROR]: %p is not free space between heap and stack.\n", addr);
+        return ERROR;
+    }
+    shm_map *map = obj_alloc(&shm_map_cache);
+    if (map == NULL) return ERROR;
+    map->seg = seg;
+    map->vpn = vpn;
+    map->next = running_block->shm_maps;
+    running_block->shm_maps = map;
+    seg->refs++;
+    for (i = 0; i < seg->npages; i++) {
+        set_pte(REGION_0, vpn + i, READ_WRITE_PERM, READ_WRITE_PERM, seg->pfns[i]);
+        region_0_pt[vpn + i].unused |= PTE_SHM;
+        frame_refcnt[seg->pfns[i]]++;
+    }
+    return 0;
+}
+
+/* Unmap the segment attached at addr from current process */
+extern int ShmDetach(void *addr) {
+    TracePrintf(0, "    [SHM_DETACH] pid %d\n", running_block->pid);
+    shm_map **itr;
+    for (itr = &running_block->shm_maps; *itr != NULL; itr = &(*itr)->next) {
+        if ((*itr)->vpn == (long)addr >> PAGESHIFT && (long)addr % PAGESIZE == 0) {
+            shm_map *map = *itr;
+            *itr = map->next;
+            shm_unmap(map);
+            return 0;
+        }
+    }
+    fprintf(stderr, "   [SHM_DETACH_ERROR]: no segment attached at %p.\n", addr);
+    return ERROR;
+}
+
 /******************************** Argument Check Util Methods ********************************/
 /* Check if an entire buffer has correct protection */
 int check_buffer(void *buf, int len, int prot) {
-    int cur_pn = (int)(((long)buf)>>PAGESHIFT);
-    for (cur_pn = (int)(((long)buf)>>PAGESHIFT);
-         cur_pn < (int)(UP_TO_PAGE((long)buf + len)>>PAGESHIFT); cur_pn++) {
-        if (!region_0_pt[cur_pn].valid || !(region_0_pt[cur_pn].kprot & prot))
-            return -1;
-    }
+    int cur_pn;
+    unsigned long waits;
+    do {    // a pass that blocked for the disk may have let pages checked before it be swapped out
+        waits = disk_waits;
+        for (cur_pn = (int)(((long)buf)>>PAGESHIFT);
+             cur_pn < (int)(UP_TO_PAGE((long)buf + len)>>PAGESHIFT); cur_pn++) {
+            if (fault_in_page(cur_pn, prot) < 0) return -1;
+            if (!region_0_pt[cur_pn].valid || !(region_0_pt[cur_pn].kprot & prot))
+                return -1;
+        }
+    } while (waits != disk_waits);
     return 0;
 }
 
@@ -1044,10 +2424,11 @@ int check_string(char *string, int prot) {
     int cur_pn = (int)(((long)string)>>PAGESHIFT);
     int i = 0;
     while(1) {
+        if (fault_in_page(cur_pn, PROT_READ) < 0) return -1;
         if (!region_0_pt[cur_pn].valid || !(region_0_pt[cur_pn].kprot & PROT_READ))
             return -1;
         while (i < ((cur_pn + 1) << PAGESHIFT) - (long)string) {
-            if (string[i] == '\0') return i;
+            if (string[i] == '\0') return check_buffer(string, i + 1, PROT_READ) < 0 ? -1 : i;
             i++;
         }
         cur_pn++;
@@ -1059,10 +2440,11 @@ int check_arg(char **arg) {
     int cur_pn = (int)(((long)arg)>>PAGESHIFT);
     int i = 0;
     while(1) {
+        if (fault_in_page(cur_pn, PROT_READ) < 0) return -1;
         if (!region_0_pt[cur_pn].valid || !(region_0_pt[cur_pn].kprot & PROT_READ))
             return -1;
         while (i * sizeof(char *) < ((cur_pn + 1) << PAGESHIFT) - (long)arg) {
-            if (arg[i] == NULL) return i;
+            if (arg[i] == NULL) return check_buffer(arg, (i + 1) * sizeof(char *), PROT_READ) < 0 ? -1 : i;
             i++;
         }
         cur_pn++;
@@ -1073,117 +2455,428 @@ int check_arg(char **arg) {
 /* Given a virtual page number, add its corresponding physical page to free page list */
 void free_page_enq(int isregion1, int vpn) {
     struct pte *region = isregion1?region_1_pt:region_0_pt;
-    if ((region[vpn].kprot & PROT_WRITE) == 0) {
-        region[vpn].kprot |= PROT_WRITE;
-        WriteRegister(REG_TLB_FLUSH, (RCS421RegVal)(long)(vpn << PAGESHIFT) + isregion1 * VMEM_REGION_SIZE);
+    int pfn = region[vpn].pfn;
+    clear_pte(isregion1, vpn);
+    free_frame(pfn);    // only the last mapping gives the page back
+}
+
+/* Drop one reference of physical page pfn and give it back to the frame allocator when it was the last.
+ * Pages mapped at boot were never counted, so a count of 0 is the last reference as well */
+void free_frame(int pfn) {
+    if (frame_refcnt[pfn] > 1) {
+        frame_refcnt[pfn]--;
+        return;
     }
-    *(int *)((long)(vpn << PAGESHIFT) + isregion1 * VMEM_REGION_SIZE) = free_page_head;
-    free_page_head = region[vpn].pfn;
-    region[vpn].valid = 0;
+    frame_refcnt[pfn] = 0;
+    buddy_free_block(pfn, 0);
     num_free_pages++;
 }
 
 /* Given a virtual page number, assign a physical page to its corresponding pte entry */
 int free_page_deq(int isregion1, int vpn, int kprot, int uprot) {
     if (num_free_pages == 0) {
+        if (zero_pool_len > 0) {    // the last free pages may be sitting in the zero pool
+            int pfn = alloc_zeroed_frame();
+            set_pte(isregion1, vpn, kprot, uprot, pfn);
+            return pfn;
+        }
         fprintf(stderr, "[PAGE_DEQ] No enough physical page\n");
         return -1;
     }
-    struct pte *region = isregion1 ? region_1_pt:region_0_pt;
-    set_pte(isregion1, vpn, kprot, uprot, free_page_head);
-    free_page_head = *(int *)((long)(vpn << PAGESHIFT) + isregion1 * VMEM_REGION_SIZE);
-    num_free_pages--;
-    return region[vpn].pfn;
+    int pfn = alloc_frame();
+    if (pfn < 0) return -1;
+    set_pte(isregion1, vpn, kprot, uprot, pfn);
+    return pfn;
 }
 
 /* Set pte of specified region with input parameters and flush corresponding TLB */
 void set_pte(int isregion1, int vpn, int kprot, int uprot, int pfn) {
     struct pte *region = isregion1 ? region_1_pt:region_0_pt;
+    int was_valid = region[vpn].valid;
+    if (!isregion1 && vpn < (KERNEL_STACK_BASE >> PAGESHIFT) && running_block != NULL) {  // track who maps user pages
+        int old = region[vpn].pfn;
+        if ((was_valid || (region[vpn].unused & PTE_NOREF)) && old != pfn
+                && frame_owner[old] == running_block->pt_phys_addr && frame_vpn[old] == vpn)
+            frame_owner[old] = NULL;
+        frame_owner[pfn] = running_block->pt_phys_addr;
+        frame_vpn[pfn] = vpn;
+    }
     region[vpn].valid = 1;
     region[vpn].kprot = kprot;
     region[vpn].uprot = uprot;
     region[vpn].pfn = pfn;
-    WriteRegister(REG_TLB_FLUSH, (RCS421RegVal)(long)((vpn << PAGESHIFT) + isregion1 * VMEM_REGION_SIZE));
+    region[vpn].unused = 0;
+    // every invalidation is flushed, so an invalid pte cannot be in the TLB unless its flush is still deferred
+    if (was_valid) {
+        tlb_flush_page(isregion1, vpn);
+    } else if (!isregion1 && tlb_batch_depth > 0) {
+        int i, pending = tlb_batch_full;
+        for (i = 0; i < tlb_batch_len && !pending; i++) {
+            if (tlb_batch_addrs[i] == (RCS421RegVal)((long)vpn << PAGESHIFT)) pending = 1;
+        }
+        if (pending) {
+            WriteRegister(REG_TLB_FLUSH, (RCS421RegVal)((long)vpn << PAGESHIFT));
+            tlb_page_flushes++;
+        }
+    }
 }
 
 /* Invalidate pte of specified region */
 void clear_pte(int isregion1, int vpn) {
     struct pte *region = isregion1 ? region_1_pt:region_0_pt;
+    int pfn = region[vpn].pfn;
+    if (!isregion1 && running_block != NULL && (region[vpn].valid || (region[vpn].unused & PTE_NOREF))
+            && frame_owner[pfn] == running_block->pt_phys_addr && frame_vpn[pfn] == vpn)
+        frame_owner[pfn] = NULL;
     region[vpn].valid = 0;
-    WriteRegister(REG_TLB_FLUSH, (RCS421RegVal)(long)((vpn << PAGESHIFT) + isregion1 * VMEM_REGION_SIZE));
+    region[vpn].unused = 0;
+    tlb_flush_page(isregion1, vpn);
 }
 
-/* Return a new physical page table */
-void *allocate_physical_pt() {
-    void *res;
-    if (upper_next_pt_pfn != -1) {
-        res = (void *)((long)(upper_next_pt_pfn << PAGESHIFT) + PAGE_TABLE_SIZE);
-        upper_next_pt_pfn = read_from_pfn(res);
-    } 
-    else if (lower_next_pt_pfn != -1) {
-        res = (void *)((long)(lower_next_pt_pfn<< PAGESHIFT));
-        lower_next_pt_pfn = read_from_pfn(res);
+/* Flush the TLB entry of a page, deferring region 0 pages while a batch is open */
+void tlb_flush_page(int isregion1, int vpn) {
+    RCS421RegVal addr = (RCS421RegVal)(long)((vpn << PAGESHIFT) + isregion1 * VMEM_REGION_SIZE);
+    if (isregion1 || tlb_batch_depth == 0) {    // region 1 mappings are used by the kernel right away
+        WriteRegister(REG_TLB_FLUSH, addr);
+        tlb_page_flushes++;
+        return;
     }
-    else {
-        if (free_page_head == -1) {
-            fprintf(stderr, "[ALLOC_NEW_PT] No more free pages\n");
-            return NULL;
+    tlb_flushes_deferred++;
+    if (tlb_batch_full) return;
+    if (tlb_batch_len == TLB_BATCH_MAX) {
+        tlb_batch_full = 1;
+        return;
+    }
+    tlb_batch_addrs[tlb_batch_len++] = addr;
+}
+
+/* Start collecting region 0 flushes instead of issuing them one by one */
+void tlb_batch_begin() {
+    tlb_batch_depth++;
+}
+
+/* Close a batch, the outermost one flushes what was collected with the fewest register writes */
+void tlb_batch_end() {
+    if (tlb_batch_depth == 0 || --tlb_batch_depth > 0) return;
+    if (tlb_batch_full) {
+        WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_0);
+        tlb_region_flushes++;
+    } else {
+        int i;
+        for (i = 0; i < tlb_batch_len; i++) {
+            WriteRegister(REG_TLB_FLUSH, tlb_batch_addrs[i]);
+            tlb_page_flushes++;
         }
-        res = (void *)((long)(free_page_head << PAGESHIFT));
-        free_page_head = read_from_pfn(res);
-        // add half of the page to upper_next_pt_pfn
-        add_half_free_pt((void *)((long)res + PAGE_TABLE_SIZE));   
-    }
-    //zero out page table
-    int k_index = UP_TO_PAGE(kernel_break - VMEM_1_BASE) >> PAGESHIFT;
-    set_pte(REGION_1, k_index, PROT_ALL, PROT_NONE, (long)(res) >> PAGESHIFT);
-    void *pt_virtual_addr = (void *)((long)(UP_TO_PAGE(kernel_break)) + (long)(res) % PAGESIZE);
-    memset(pt_virtual_addr,'\0', PAGE_TABLE_SIZE);
-    clear_pte(REGION_1, k_index);
-    return res;
+    }
+    tlb_batch_len = 0;
+    tlb_batch_full = 0;
 }
 
-/* Add half free page to upper_next_pt_pfn or lower_next_pt_pfn*/
-void add_half_free_pt(void *physical_pt) {
-    long pt_val = (long)physical_pt;
-    if (pt_val % PAGESIZE != 0) {
-        write_to_pfn(physical_pt, upper_next_pt_pfn);
-        upper_next_pt_pfn = pt_val >> PAGESHIFT;
+/* Return a new zero filled physical page table, preferring one that is already zeroed */
+void *allocate_physical_pt() {
+    pt_slab *slab, *best = NULL;
+    int i;
+    for (slab = pt_slab_head; slab != NULL; slab = slab->next) {
+        if (slab->zeroed != 0) {
+            best = slab;
+            break;
+        }
+        if (best == NULL || (best->used == 0 && slab->used != 0)) best = slab;  // fill used pages first
+    }
+    if (best == NULL && (best = new_pt_slab()) == NULL) {
+        fprintf(stderr, "[ALLOC_NEW_PT] No more free pages\n");
+        return NULL;
+    }
+    unsigned int free_slots = ~best->used & PT_ALL_SLOTS;
+    unsigned int pick = best->zeroed != 0 ? best->zeroed : free_slots;
+    for (i = 0; (pick & (1 << i)) == 0; i++);
+    void *res = (void *)(((long)best->pfn << PAGESHIFT) + i * PAGE_TABLE_SIZE);
+    if (best->zeroed & (1 << i)) {
+        best->zeroed &= ~(1 << i);
+        pt_free_zeroed--;
     } else {
-        write_to_pfn(physical_pt, lower_next_pt_pfn);
-        lower_next_pt_pfn = pt_val >> PAGESHIFT;
+        void *page = kmap(best->pfn);
+        if (page == NULL) return NULL;
+        memset((void *)((long)page + i * PAGE_TABLE_SIZE), '\0', PAGE_TABLE_SIZE);
+        kunmap(page);
+    }
+    best->used |= 1 << i;
+    pt_free--;
+    pt_live++;
+    if (best->used == PT_ALL_SLOTS) {   // full, take it off the list
+        if (best->prev != NULL) best->prev->next = best->next;
+        else pt_slab_head = best->next;
+        if (best->next != NULL) best->next->prev = best->prev;
+    }
+    return res;
+}
+
+/* Take a zero filled page for page tables */
+pt_slab *new_pt_slab() {
+    pt_slab *slab = (pt_slab *)malloc(sizeof(pt_slab));
+    if (slab == NULL) return NULL;
+    slab->pfn = alloc_zeroed_frame();
+    if (slab->pfn < 0) {
+        free(slab);
+        return NULL;
+    }
+    slab->used = 0;
+    slab->zeroed = PT_ALL_SLOTS;
+    slab->prev = NULL;
+    slab->next = pt_slab_head;
+    if (pt_slab_head != NULL) pt_slab_head->prev = slab;
+    pt_slab_head = slab;
+    frame_slab[slab->pfn] = slab;
+    pt_free += PT_PER_PAGE;
+    pt_free_zeroed += PT_PER_PAGE;
+    pt_slab_pages++;
+    return slab;
+}
+
+/* Give back a page table, the page goes back to the frame allocator once none of its tables is used */
+void free_physical_pt(void *physical_pt) {
+    int pfn = (long)physical_pt >> PAGESHIFT;
+    int i = ((long)physical_pt % PAGESIZE) / PAGE_TABLE_SIZE;
+    pt_slab *slab = frame_slab[pfn];
+    if (slab == NULL || (slab->used & (1 << i)) == 0) {
+        fprintf(stderr, "[FREE_PT] %p is not an allocated page table\n", physical_pt);
+        return;
+    }
+    if (slab->used == PT_ALL_SLOTS) {   // was full, put it back on the list
+        slab->prev = NULL;
+        slab->next = pt_slab_head;
+        if (pt_slab_head != NULL) pt_slab_head->prev = slab;
+        pt_slab_head = slab;
+    }
+    slab->used &= ~(1 << i);
+    pt_live--;
+    pt_free++;
+    if (slab->used != 0) return;
+    // keep an empty page if its zeroed tables are still needed for the reserve
+    int nzeroed = 0;
+    for (i = 0; i < PT_PER_PAGE; i++) if (slab->zeroed & (1 << i)) nzeroed++;
+    if (nzeroed > 0 && pt_free_zeroed - nzeroed < PT_ZERO_RESERVE) return;
+    if (slab->prev != NULL) slab->prev->next = slab->next;
+    else pt_slab_head = slab->next;
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+    frame_slab[pfn] = NULL;
+    pt_free -= PT_PER_PAGE;
+    pt_free_zeroed -= nzeroed;
+    pt_slab_pages--;
+    pt_pages_returned++;
+    free_frame(pfn);
+    free(slab);
+}
+
+/* Zero free page tables, or take a zeroed page, until PT_ZERO_RESERVE tables are ready for Fork */
+void refill_pt_reserve(int budget) {
+    pt_slab *slab;
+    int i;
+    for (slab = pt_slab_head; slab != NULL && budget > 0 && pt_free_zeroed < PT_ZERO_RESERVE; slab = slab->next) {
+        unsigned int dirty = ~slab->used & ~slab->zeroed & PT_ALL_SLOTS;
+        if (dirty == 0) continue;
+        void *page = kmap(slab->pfn);
+        if (page == NULL) return;
+        for (i = 0; i < PT_PER_PAGE && budget > 0 && pt_free_zeroed < PT_ZERO_RESERVE; i++) {
+            if ((dirty & (1 << i)) == 0) continue;
+            memset((void *)((long)page + i * PAGE_TABLE_SIZE), '\0', PAGE_TABLE_SIZE);
+            slab->zeroed |= 1 << i;
+            pt_free_zeroed++;
+            budget--;
+        }
+        kunmap(page);
     }
+    if (pt_free_zeroed < PT_ZERO_RESERVE && budget > 0 && num_free_pages > 0) new_pt_slab();
 }
 
-/* Read next available free pfn/half_pt_pfn of passed in physical_addr */
-int read_from_pfn(void *physical_addr) {
-    if ((long)kernel_break >= VMEM_LIMIT) {
-        fprintf(stderr, "[READ_PFN] Kernel virtual space full, cannot read from physical address\n");
+/* Take a single free physical page from the frame allocator */
+int alloc_frame() {
+    if (num_free_pages == 0) {
+        if (zero_pool_len > 0) return alloc_zeroed_frame();
+        fprintf(stderr, "[ALLOC_FRAME] No enough physical page\n");
         return -1;
     }
-    int k_index = UP_TO_PAGE(kernel_break - VMEM_1_BASE) >> PAGESHIFT;
-    set_pte(REGION_1, k_index, PROT_ALL, PROT_NONE, (long)physical_addr >> PAGESHIFT);
-    int res = *(int *)(VMEM_1_BASE + (k_index << PAGESHIFT) + (long)physical_addr % PAGESIZE);
-    clear_pte(REGION_1, k_index);
-    return res;
+    int pfn = buddy_alloc_block(0);
+    frame_refcnt[pfn] = 1;
+    num_free_pages--;
+    return pfn;
+}
+
+/* Take npages physically contiguous free pages, returns pfn of the first one */
+int alloc_frames(int npages) {
+    int order = 0, i;
+    while ((1 << order) < npages) order++;
+    if (npages <= 0 || order > BUDDY_MAX_ORDER || npages > num_free_pages) return -1;
+    int pfn = buddy_alloc_block(order);
+    if (pfn < 0) {
+        fprintf(stderr, "[ALLOC_FRAMES] No %d contiguous physical pages\n", npages);
+        return -1;
+    }
+    buddy_free_range(pfn + npages, pfn + (1 << order));    // give back the tail of the block
+    for (i = 0; i < npages; i++) frame_refcnt[pfn + i] = 1;
+    num_free_pages -= npages;
+    return pfn;
+}
+
+/* Mark the pages of a block free or in use in frame_free_map */
+void buddy_mark(int pfn, int order, int isfree) {
+    int i;
+    for (i = pfn; i < pfn + (1 << order); i++) {
+        if (isfree) frame_free_map[i >> 3] |= 1 << (i & 7);
+        else frame_free_map[i >> 3] &= ~(1 << (i & 7));
+    }
+}
+
+void buddy_insert(int pfn, int order) {
+    frame_order[pfn] = order;
+    buddy_prev[pfn] = -1;
+    buddy_next[pfn] = buddy_head[order];
+    if (buddy_head[order] != -1) buddy_prev[buddy_head[order]] = pfn;
+    buddy_head[order] = pfn;
+    buddy_nblocks[order]++;
+}
+
+void buddy_remove(int pfn, int order) {
+    if (buddy_prev[pfn] != -1) buddy_next[buddy_prev[pfn]] = buddy_next[pfn];
+    else buddy_head[order] = buddy_next[pfn];
+    if (buddy_next[pfn] != -1) buddy_prev[buddy_next[pfn]] = buddy_prev[pfn];
+    frame_order[pfn] = FRAME_NOT_HEAD;
+    buddy_nblocks[order]--;
 }
 
-/* Write next available free pfn/half_pt_pfn into passed in physical_addr */
-void write_to_pfn(void *physical_addr, int towrite) {
-    if ((long)kernel_break >= VMEM_LIMIT) {
-        fprintf(stderr, "[WRITE_PFN] Kernel virtual space full, cannot write to physical address\n");
+/* Free pfns [start, end), carving the range into the largest aligned blocks that fit */
+void buddy_free_range(int start, int end) {
+    while (start < end) {
+        int order = 0;
+        while (order < BUDDY_MAX_ORDER && (start & ((2 << order) - 1)) == 0 && start + (2 << order) <= end) order++;
+        buddy_mark(start, order, 1);
+        buddy_insert(start, order);
+        start += 1 << order;
+    }
+}
+
+void buddy_free_block(int pfn, int order) {
+    if (FRAME_FREE(pfn)) {
+        fprintf(stderr, "[BUDDY_FREE] Physical page %d is already free\n", pfn);
         return;
     }
-    int k_index = UP_TO_PAGE(kernel_break - VMEM_1_BASE) >> PAGESHIFT;
-    set_pte(REGION_1, k_index, PROT_ALL, PROT_NONE, (long)physical_addr >> PAGESHIFT);
-    *(int *)(VMEM_1_BASE + (k_index << PAGESHIFT) + (long)physical_addr % PAGESIZE) = towrite;
-    clear_pte(REGION_1, k_index);
+    buddy_mark(pfn, order, 1);
+    while (order < BUDDY_MAX_ORDER) {
+        int buddy = pfn ^ (1 << order);
+        if (buddy >= num_frames || frame_order[buddy] != order) break;
+        buddy_remove(buddy, order);
+        pfn &= ~(1 << order);
+        order++;
+    }
+    buddy_insert(pfn, order);
+}
+
+int buddy_alloc_block(int order) {
+    int cur = order;
+    while (cur <= BUDDY_MAX_ORDER && buddy_head[cur] == -1) cur++;
+    if (cur > BUDDY_MAX_ORDER) return -1;
+    int pfn = buddy_head[cur];
+    buddy_remove(pfn, cur);
+    while (cur > order) {   // split, keeping the lower half
+        cur--;
+        buddy_insert(pfn + (1 << cur), cur);
+    }
+    buddy_mark(pfn, order, 0);
+    return pfn;
+}
+
+/* Take a zero filled page from the zero pool, zeroing one on the spot when the pool ran dry */
+int alloc_zeroed_frame() {
+    int pfn;
+    if (zero_pool_len > 0) {
+        zero_pool_hits++;
+        pfn = zero_pool[--zero_pool_len];
+        frame_refcnt[pfn] = 1;
+        if (zero_pool_len < zero_pool_low) zero_pool_refilling = 1;
+        return pfn;
+    }
+    zero_pool_empty++;
+    zero_pool_refilling = 1;
+    pfn = alloc_frame();
+    if (pfn < 0) return -1;
+    void *page = kmap(pfn);
+    if (page == NULL) {
+        free_frame(pfn);
+        return -1;
+    }
+    memset(page, '\0', PAGESIZE);
+    kunmap(page);
+    return pfn;
+}
+
+/* Map a zero filled page at vpn of current region 0 */
+int map_zeroed_page(int vpn, int kprot, int uprot) {
+    int pfn = alloc_zeroed_frame();
+    if (pfn < 0) return -1;
+    set_pte(REGION_0, vpn, kprot, uprot, pfn);
+    return pfn;
+}
+
+/* Move free pages into the zero pool, zeroing them, once it fell below the low watermark */
+void refill_zero_pool(int budget) {
+    int high = zero_pool_high < ZERO_POOL_MAX ? zero_pool_high : ZERO_POOL_MAX;
+    if (!zero_pool_refilling) return;
+    while (budget-- > 0 && zero_pool_len < high && num_free_pages > 0) {
+        int pfn = alloc_frame();
+        void *page = kmap(pfn);
+        if (page == NULL) {
+            free_frame(pfn);
+            return;
+        }
+        memset(page, '\0', PAGESIZE);
+        kunmap(page);
+        zero_pool[zero_pool_len++] = pfn;
+        zero_pool_filled++;
+    }
+    if (zero_pool_len >= high) zero_pool_refilling = 0;
+}
+
+/* Map physical page pfn into one of the kmap slots, reusing the least recently used free slot */
+void *kmap(int pfn) {
+    int i, victim = -1;
+    kmap_clock++;
+    for (i = 0; i < KMAP_SLOTS; i++) {
+        if (kmap_slots[i].pfn == pfn) {
+            kmap_hits++;
+            kmap_slots[i].pins++;
+            kmap_slots[i].last_use = kmap_clock;
+            return (void *)(KMAP_BASE + ((long)i << PAGESHIFT));
+        }
+        if (kmap_slots[i].pins == 0 && (victim == -1 || kmap_slots[i].last_use < kmap_slots[victim].last_use))
+            victim = i;
+    }
+    if (victim == -1) {
+        fprintf(stderr, "[KMAP] All %d kmap slots are pinned\n", KMAP_SLOTS);
+        return NULL;
+    }
+    kmap_misses++;
+    if (kmap_slots[victim].pfn != -1) kmap_evictions++;
+    set_pte(REGION_1, ((KMAP_BASE - VMEM_1_BASE) >> PAGESHIFT) + victim, READ_WRITE_PERM, PROT_NONE, pfn);    // flushes only on eviction
+    kmap_slots[victim].pfn = pfn;
+    kmap_slots[victim].pins = 1;
+    kmap_slots[victim].last_use = kmap_clock;
+    return (void *)(KMAP_BASE + ((long)victim << PAGESHIFT));
+}
+
+/* Release a pin taken by kmap, the page stays mapped until its slot is evicted */
+void kunmap(void *vaddr) {
+    int i = (DOWN_TO_PAGE(vaddr) - KMAP_BASE) >> PAGESHIFT;
+    if (i < 0 || i >= KMAP_SLOTS || kmap_slots[i].pins == 0) return;
+    kmap_slots[i].pins--;
 }
 
 /* set valid bit of region_0_pt pte to 1 */
 void validate_region_0_pt() {
     int region_0_pt_idx = (VMEM_REGION_SIZE >> PAGESHIFT) - 2;
-    set_pte(REGION_1, region_0_pt_idx, PROT_ALL, PROT_NONE, (long)(running_block->pt_phys_addr)>>PAGESHIFT);
+    if (region_1_pt[region_0_pt_idx].valid && region_1_pt[region_0_pt_idx].pfn == (long)(running_block->pt_phys_addr)>>PAGESHIFT)
+        pt_remaps_avoided++;    // page table shares its page with the previous one, the mapping is already right
+    else
+        set_pte(REGION_1, region_0_pt_idx, PROT_ALL, PROT_NONE, (long)(running_block->pt_phys_addr)>>PAGESHIFT);
     region_0_pt = (struct pte *) (VMEM_1_LIMIT - 2 * PAGESIZE + (long)(running_block->pt_phys_addr)%PAGESIZE);
 }
 
@@ -1196,29 +2889,424 @@ void *v2p(void *vaddr) {
 
 /* Copy a page at given vpn to physical_pt */
 int copy_page(int vpn, void *physical_pt) {
-    if ((long)kernel_break >= VMEM_LIMIT) {
-        fprintf(stderr, "   [FORK_ERROR] Kernel virtual space full, cannot fork\n");
-        return ERROR;
-    }
-    int k_index = UP_TO_PAGE(kernel_break - VMEM_1_BASE) >> PAGESHIFT;
-    int pfn = free_page_deq(REGION_1, k_index, PROT_ALL, PROT_NONE);    // deq a free page from region 1
+    int pfn = alloc_frame();
     if (pfn < 0) {
         fprintf(stderr, "   [FORK_ERROR] Cannot copy memory image for fork\n");
         return ERROR;
     }
-    memcpy((void *)((long)(UP_TO_PAGE(kernel_break))), (void *)((long)(vpn << PAGESHIFT)), PAGESIZE);
-    clear_pte(REGION_1, k_index);
+    void *page = kmap(pfn);
+    if (page == NULL) {
+        free_frame(pfn);
+        return ERROR;
+    }
+    memcpy(page, (void *)((long)(vpn << PAGESHIFT)), PAGESIZE);
+    kunmap(page);
 
-    set_pte(REGION_1, k_index, PROT_ALL, PROT_NONE, (long)(physical_pt) >> PAGESHIFT);
-    struct pte *new_pt_virtual_addr = (struct pte *)((long)(UP_TO_PAGE(kernel_break)) + (long)(physical_pt) % PAGESIZE);
+    void *pt_page = kmap((long)(physical_pt) >> PAGESHIFT);
+    if (pt_page == NULL) {
+        free_frame(pfn);
+        return ERROR;
+    }
+    struct pte *new_pt_virtual_addr = (struct pte *)((long)pt_page + (long)(physical_pt) % PAGESIZE);
     new_pt_virtual_addr[vpn].valid = 1;
     new_pt_virtual_addr[vpn].kprot = region_0_pt[vpn].kprot;
     new_pt_virtual_addr[vpn].uprot = region_0_pt[vpn].uprot;
     new_pt_virtual_addr[vpn].pfn = pfn;
-    clear_pte(REGION_1, k_index);
+    kunmap(pt_page);
+    return 0;
+}
+
+/* Map every valid user page of current process into physical_pt, writable pages become copy-on-write */
+int share_pages(void *physical_pt) {
+    void *pt_page = kmap((long)(physical_pt) >> PAGESHIFT);
+    if (pt_page == NULL) {
+        fprintf(stderr, "   [FORK_ERROR] Cannot map page table of child, cannot fork\n");
+        return ERROR;
+    }
+    struct pte *new_pt_virtual_addr = (struct pte *)((long)pt_page + (long)(physical_pt) % PAGESIZE);
+    int vpn;
+    tlb_batch_begin();
+    for (vpn = MEM_INVALID_PAGES; vpn < KERNEL_STACK_BASE >> PAGESHIFT; vpn++) {
+        if (region_0_pt[vpn].unused & PTE_NOREF) {  // shared pages are not swapped out, count it as referenced
+            region_0_pt[vpn].valid = 1;
+            region_0_pt[vpn].unused &= ~PTE_NOREF;
+        }
+        if (region_0_pt[vpn].unused & PTE_SWAPPED) {    // both processes read their own copy back
+            new_pt_virtual_addr[vpn] = region_0_pt[vpn];
+            swap_refcnt[region_0_pt[vpn].pfn]++;
+            continue;
+        }
+        if (!region_0_pt[vpn].valid) continue;
+        if ((region_0_pt[vpn].uprot & PROT_WRITE) && !(region_0_pt[vpn].unused & PTE_SHM)) {
+            region_0_pt[vpn].kprot = PROT_READ;
+            region_0_pt[vpn].uprot = PROT_READ;
+            region_0_pt[vpn].unused |= PTE_COW;
+            tlb_flush_page(REGION_0, vpn);
+        }
+        new_pt_virtual_addr[vpn] = region_0_pt[vpn];
+        frame_refcnt[region_0_pt[vpn].pfn]++;
+    }
+    tlb_batch_end();
+    kunmap(pt_page);
+    return 0;
+}
+
+/* Resolve a write to copy-on-write page vpn, copying it only if another process still maps it */
+int cow_break(int vpn) {
+    int old_pfn = region_0_pt[vpn].pfn;
+    if (frame_refcnt[old_pfn] == 1) {   // the other sharers are gone, just take the page back
+        set_pte(REGION_0, vpn, READ_WRITE_PERM, READ_WRITE_PERM, old_pfn);
+        return 0;
+    }
+    int pfn = alloc_frame();
+    if (pfn < 0) {
+        fprintf(stderr, "   [COW_ERROR] Cannot copy page %d for pid %d\n", vpn, running_block->pid);
+        return ERROR;
+    }
+    void *page = kmap(pfn);
+    if (page == NULL) {
+        free_frame(pfn);
+        return ERROR;
+    }
+    memcpy(page, (void *)((long)(vpn << PAGESHIFT)), PAGESIZE);
+    kunmap(page);
+    frame_refcnt[old_pfn]--;
+    set_pte(REGION_0, vpn, READ_WRITE_PERM, READ_WRITE_PERM, pfn);
+    TracePrintf(0, "    Copied copy-on-write page %d for pid %d\n", vpn, running_block->pid);
+    return 0;
+}
+
+/* Make user page vpn of current process present (and writable for PROT_WRITE) if it is a legal
+ * lazily allocated or copy-on-write page. Return 0 if the page can now be accessed, -1 otherwise */
+int fault_in_page(int vpn, int prot) {
+    if (vpn < MEM_INVALID_PAGES || vpn >= (KERNEL_STACK_BASE >> PAGESHIFT)) return -1;
+    if ((!region_0_pt[vpn].valid && !(region_0_pt[vpn].unused & PTE_NOREF))
+            || ((prot & PROT_WRITE) && (region_0_pt[vpn].unused & PTE_COW)))
+        reclaim_frames();   // a physical page will be needed
+    if (region_0_pt[vpn].unused & PTE_NOREF) {  // still resident, the clock hand was only watching for a reference
+        region_0_pt[vpn].valid = 1;
+        region_0_pt[vpn].unused &= ~PTE_NOREF;
+        swap_soft_faults++;
+    }
+    if ((region_0_pt[vpn].unused & PTE_SWAPPED) && swap_in(vpn) < 0) return -1;
+    if (region_0_pt[vpn].valid) {
+        if ((prot & PROT_WRITE) && (region_0_pt[vpn].unused & PTE_COW)) return cow_break(vpn);
+        return 0;
+    }
+    if (vpn - MEM_INVALID_PAGES < running_block->exec_npg) return load_image_page(vpn);
+    if (vpn < running_block->brk_pn) {  // demand zero heap page
+        if (map_zeroed_page(vpn, READ_WRITE_PERM, READ_WRITE_PERM) < 0) return -1;
+        TracePrintf(0, "    Demand zero heap page %d for pid %d\n", vpn, running_block->pid);
+        return 0;
+    }
+    return -1;
+}
+
+/* Bring in a page of the program image of current process: shared text if resident, otherwise read
+ * from the executable, with the part beyond the text and data (the bss) zero filled */
+int load_image_page(int vpn) {
+    int idx = vpn - MEM_INVALID_PAGES;
+    int is_text = idx < running_block->exec_text_npg;
+    text_entry *text = running_block->text;
+    if (is_text && text != NULL && text->pfns[idx] != -1) {
+        set_pte(REGION_0, vpn, PROT_READ | PROT_EXEC, PROT_READ | PROT_EXEC, text->pfns[idx]);
+        frame_refcnt[text->pfns[idx]]++;
+        exec_pages_loaded(1);
+        return 0;
+    }
+    if (((long)idx << PAGESHIFT) >= running_block->exec_size)   // pure bss page
+        return map_zeroed_page(vpn, READ_WRITE_PERM, READ_WRITE_PERM) < 0 ? -1 : 0;
+    if (running_block->image == NULL && running_block->exec_fd < 0) return -1;
+    int pfn = free_page_deq(REGION_0, vpn, READ_WRITE_PERM, is_text ? PROT_READ | PROT_EXEC : READ_WRITE_PERM);
+    if (pfn < 0) return -1;
+    long start = (long)idx << PAGESHIFT;
+    long len = 0;
+    if (start < running_block->exec_size)
+        len = running_block->exec_size - start < PAGESIZE ? running_block->exec_size - start : PAGESIZE;
+    if (running_block->image != NULL) memcpy((void *)((long)vpn << PAGESHIFT), running_block->image->bytes + start, len);
+    else if (pread(running_block->exec_fd, (void *)((long)vpn << PAGESHIFT), len, running_block->exec_offset + start) != len) {
+        fprintf(stderr, "   [LOAD_PAGE_ERROR] Cannot read page %d of pid %d from its executable\n", vpn, running_block->pid);
+        free_page_enq(REGION_0, vpn);
+        return -1;
+    }
+    memset((void *)(((long)vpn << PAGESHIFT) + len), '\0', PAGESIZE - len);
+    if (is_text) {
+        set_pte(REGION_0, vpn, PROT_READ | PROT_EXEC, PROT_READ | PROT_EXEC, pfn);
+        if (text != NULL) {
+            text->pfns[idx] = pfn;
+            frame_refcnt[pfn]++;
+        }
+    }
+    TracePrintf(0, "    Loaded %s page %d of pid %d on first touch\n", is_text ? "text" : "data", vpn, running_block->pid);
+    exec_pages_loaded(1);
+    return 0;
+}
+
+/* Map zero filled stack pages from addr up to the current stack bottom. A fault soon after the previous
+ * one doubles the number of pages mapped below addr, up to STACK_CHUNK_MAX, so a deep recursion takes
+ * a few faults instead of one per page. The page above brk stays unmapped as the red zone */
+int grow_stack(void *addr) {
+    pcb *p = running_block;
+    int top = DOWN_TO_PAGE((long)p->stack_allocated_addr) >> PAGESHIFT;
+    int bottom = DOWN_TO_PAGE((long)addr) >> PAGESHIFT;
+    int itr;
+    if (p->stack_faults > 0 && sys_time - p->stack_fault_time < STACK_FAULT_WINDOW)
+        p->stack_chunk = p->stack_chunk * 2 < STACK_CHUNK_MAX ? p->stack_chunk * 2 : STACK_CHUNK_MAX;
+    else
+        p->stack_chunk = 1;
+    p->stack_faults++;
+    p->stack_fault_time = sys_time;
+    bottom -= p->stack_chunk - 1;
+    if (bottom <= p->brk_pn) bottom = p->brk_pn + 1;
+    shm_map *map;
+    for (map = p->shm_maps; map != NULL; map = map->next) {
+        int end = map->vpn + map->seg->npages;  // page at end is the red zone between segment and stack
+        if (end >= top) continue;
+        if ((DOWN_TO_PAGE((long)addr) >> PAGESHIFT) <= end) return -1;
+        if (bottom <= end) bottom = end + 1;
+    }
+    reclaim_frames();
+    tlb_batch_begin();
+    for (itr = bottom; itr < top; itr++) {
+        if (map_zeroed_page(itr, READ_WRITE_PERM, READ_WRITE_PERM) < 0) break;
+    }
+    tlb_batch_end();
+    if (itr < top) {    // keep the stack contiguous, give back what was mapped
+        tlb_batch_begin();
+        while (--itr >= bottom) release_user_page(itr);
+        tlb_batch_end();
+        return -1;
+    }
+    TracePrintf(0, "    User stack break updated from %p to %p, %d pages are added\n", p->stack_allocated_addr,
+        (void *)((long)bottom << PAGESHIFT), top - bottom);
+    if (bottom < top) p->stack_allocated_addr = (void *)((long)bottom << PAGESHIFT);
+    return 0;
+}
+
+/* Give back stack pages more than STACK_RECLAIM_SLACK pages below the user sp of current process,
+ * left behind by a stack that has unwound since */
+void reclaim_stack(void *sp) {
+    pcb *p = running_block;
+    int bottom = DOWN_TO_PAGE((long)p->stack_allocated_addr) >> PAGESHIFT;
+    int keep = (DOWN_TO_PAGE((long)sp) >> PAGESHIFT) - STACK_RECLAIM_SLACK;
+    int itr;
+    if (keep <= bottom) return;
+    tlb_batch_begin();
+    for (itr = bottom; itr < keep; itr++) release_user_page(itr);
+    tlb_batch_end();
+    p->stack_reclaimed += keep - bottom;
+    p->stack_allocated_addr = (void *)((long)keep << PAGESHIFT);
+    p->stack_chunk = 1;
+    TracePrintf(0, "    Reclaimed %d stack pages of pid %d below sp %p\n", keep - bottom, p->pid, sp);
+}
+
+shm_seg *shm_lookup(int id) {
+    shm_seg *seg;
+    for (seg = shm_head; seg != NULL && seg->id != id; seg = seg->next);
+    return seg;
+}
+
+/* Drop a reference to seg, its pages are freed after the last attachment and its creator are gone */
+void shm_put(shm_seg *seg) {
+    int i;
+    if (--seg->refs > 0) return;
+    shm_seg **itr;
+    for (itr = &shm_head; *itr != seg; itr = &(*itr)->next);
+    *itr = seg->next;
+    for (i = 0; i < seg->npages; i++) free_frame(seg->pfns[i]);
+    free(seg->pfns);
+    free(seg);
+}
+
+/* Unmap the pages of map from current process and free map, which is already off the shm_maps list */
+void shm_unmap(shm_map *map) {
+    int i;
+    tlb_batch_begin();
+    for (i = 0; i < map->seg->npages; i++) free_page_enq(REGION_0, map->vpn + i);
+    tlb_batch_end();
+    shm_put(map->seg);
+    obj_free(&shm_map_cache, map);
+}
+
+void shm_detach_all() {
+    while (running_block->shm_maps != NULL) {
+        shm_map *map = running_block->shm_maps;
+        running_block->shm_maps = map->next;
+        shm_unmap(map);
+    }
+}
+
+int shm_overlaps(int start, int end) {
+    shm_map *map;
+    for (map = running_block->shm_maps; map != NULL; map = map->next) {
+        if (map->vpn < end && map->vpn + map->seg->npages > start) return 1;
+    }
+    return 0;
+}
+
+/* Give back user page vpn of current process, whether it is resident or swapped out */
+void release_user_page(int vpn) {
+    if (region_0_pt[vpn].valid || (region_0_pt[vpn].unused & PTE_NOREF)) {
+        free_page_enq(REGION_0, vpn);
+    } else if (region_0_pt[vpn].unused & PTE_SWAPPED) {
+        swap_slot_put(region_0_pt[vpn].pfn);
+        region_0_pt[vpn].unused = 0;
+    }
+}
+
+/* Return the pte mapping physical page pfn if pfn is a private, not copy-on-write user page with nrefs
+ * references that the clock hand may age or swap out. The owner's page table is mapped into *page when
+ * it is not the current one, the caller has to kunmap it */
+struct pte *swappable_pte(int pfn, int nrefs, void **page) {
+    void *pt = frame_owner[pfn];
+    struct pte *p;
+    *page = NULL;
+    if (pt == NULL || frame_refcnt[pfn] != nrefs) return NULL;
+    if (pt == running_block->pt_phys_addr) {
+        p = &region_0_pt[frame_vpn[pfn]];
+    } else {
+        if ((*page = kmap((long)pt >> PAGESHIFT)) == NULL) return NULL;
+        p = (struct pte *)((long)*page + (long)pt % PAGESIZE) + frame_vpn[pfn];
+    }
+    if (p->pfn == pfn && (p->valid || (p->unused & PTE_NOREF)) && !(p->unused & PTE_COW)) return p;
+    if (*page != NULL) kunmap(*page);
+    *page = NULL;
+    return NULL;
+}
+
+/* Move the clock hand over nframes frames, invalidating the resident pages it passes so that the next
+ * reference to them is caught by trap_memory_handler (emulated reference bit) */
+void swap_age_pages(int nframes) {
+    while (nframes-- > 0) {
+        int pfn = clock_hand;
+        void *page;
+        clock_hand = (clock_hand + 1) % num_frames;
+        struct pte *p = swappable_pte(pfn, 1, &page);
+        if (p == NULL) continue;
+        if (p->valid) {
+            p->valid = 0;
+            p->unused |= PTE_NOREF;
+            if (page == NULL) tlb_flush_page(REGION_0, frame_vpn[pfn]);  // other page tables are not in the TLB
+            swap_aged++;
+        }
+        if (page != NULL) kunmap(page);
+    }
+}
+
+/* Swap out a page that was not referenced since the clock hand last passed it. Pages of current process
+ * are left alone so that the pages it is bringing in cannot push each other out. Return 0 if a page was
+ * written out (even if its owner touched it meanwhile and it was kept), -1 if nothing could be swapped */
+int swap_out_one() {
+    int scanned, pfn = -1;
+    void *page;
+    struct pte *p;
+    if (swap_slots_used == num_swap_slots) return -1;
+    for (scanned = 0; scanned < 2 * num_frames && pfn < 0; scanned++) {    // second chance for referenced pages
+        int cur = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+        if (frame_owner[cur] == running_block->pt_phys_addr) continue;
+        if ((p = swappable_pte(cur, 1, &page)) == NULL) continue;
+        if (p->valid) {
+            p->valid = 0;
+            p->unused |= PTE_NOREF;
+            swap_aged++;
+        } else {
+            pfn = cur;
+        }
+        if (page != NULL) kunmap(page);
+    }
+    if (pfn < 0) return -1;
+    int slot = swap_slot_get();
+    frame_refcnt[pfn]++;    // keep the page while it is written out
+    if (swap_page_io(DISK_WRITE, slot, pfn) == 0 && (p = swappable_pte(pfn, 2, &page)) != NULL && !p->valid) {
+        p->unused = PTE_SWAPPED;
+        p->pfn = slot;
+        frame_owner[pfn] = NULL;
+        if (page != NULL) kunmap(page);
+        frame_refcnt[pfn]--;
+        swap_outs++;
+    } else {    // the owner referenced, shared or gave back the page while the disk was busy
+        if (p != NULL && page != NULL) kunmap(page);
+        swap_slot_put(slot);
+        swap_aborted++;
+    }
+    free_frame(pfn);
     return 0;
 }
 
+/* Read swapped out page vpn of current process back into a new physical page */
+int swap_in(int vpn) {
+    int slot = region_0_pt[vpn].pfn;
+    int pfn = alloc_frame();
+    if (pfn < 0) return -1;
+    if (swap_page_io(DISK_READ, slot, pfn) < 0) {
+        free_frame(pfn);
+        return -1;
+    }
+    set_pte(REGION_0, vpn, region_0_pt[vpn].kprot, region_0_pt[vpn].uprot, pfn);
+    swap_slot_put(slot);
+    swap_ins++;
+    TracePrintf(0, "    Swapped in page %d of pid %d from slot %d\n", vpn, running_block->pid, slot);
+    return 0;
+}
+
+/* Swap pages of other processes out until SWAP_RESERVE physical pages are free. Only called where
+ * current process may block, kernel allocations take from the reserve without waiting for the disk */
+void reclaim_frames() {
+    int tries;
+    if (num_swap_slots == 0 || tlb_batch_depth > 0) return;
+    for (tries = 0; num_free_pages + zero_pool_len < SWAP_RESERVE && tries < 2 * SWAP_RESERVE; tries++) {
+        if (swap_out_one() < 0) return;
+    }
+}
+
+int swap_slot_get() {
+    int i;
+    for (i = 0; i < num_swap_slots; i++) {
+        int slot = (swap_rotor + i) % num_swap_slots;
+        if (swap_refcnt[slot] == 0) {
+            swap_refcnt[slot] = 1;
+            swap_rotor = slot + 1;
+            swap_slots_used++;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void swap_slot_put(int slot) {
+    if (--swap_refcnt[slot] == 0) swap_slots_used--;
+}
+
+/* Transfer physical page pfn to or from swap slot, one sector at a time, blocking current process
+ * until the disk is done. Only one process uses the disk at a time, the others wait on DISK_Q */
+int swap_page_io(int op, int slot, int pfn) {
+#ifdef _LAB3
+    int i;
+    while (disk_busy) {
+        add_next_proc_on_queue(DISK_Q, running_block);
+        disk_waits++;
+        ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+    }
+    disk_busy = 1;
+    void *page = kmap(pfn);     // stays pinned while the disk works on it
+    if (page != NULL) {
+        for (i = 0; i < SECTORS_PER_PAGE; i++) {
+            disk_waiter = running_block;
+            disk_waits++;
+            DiskAccess(op, slot * SECTORS_PER_PAGE + i, (void *)((long)page + i * SECTORSIZE));
+            ContextSwitch(MySwitchFunc, &running_block->ctx, (void *)running_block, (void *)get_next_proc_on_queue(READY_Q));
+        }
+        kunmap(page);
+    }
+    disk_busy = 0;
+    if (disk_head != NULL) add_next_proc_on_queue(READY_Q, get_next_proc_on_queue(DISK_Q));
+    return page == NULL ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
 /* Print valid entries of region_0_pt and region_1_pt */
 void print_pt(){
     int i;
@@ -1232,6 +3320,48 @@ void print_pt(){
     }
 }
 
+/* Print kernel counters, called right before Yalnix halts */
+void print_stats() {
+    obj_cache *caches[] = {&pcb_cache, &cei_cache, &line_cache, &group_cache};
+    int c;
+    for (c = 0; c < sizeof(caches) / sizeof(caches[0]); c++) {
+        TracePrintf(0, "[STATS] %s cache: %d live, %d free, high water %d, %lu chunks\n", caches[c]->name,
+            caches[c]->live, caches[c]->nfree, caches[c]->high_water, caches[c]->chunks);
+    }
+    TracePrintf(0, "[STATS] swap: %lu pages out, %lu pages in, %lu aged, %lu soft faults, %lu aborted, %d of %d slots used\n",
+        swap_outs, swap_ins, swap_aged, swap_soft_faults, swap_aborted, swap_slots_used, num_swap_slots);
+    TracePrintf(0, "[STATS] page tables: %d live, %d free (%d zeroed) in %d pages, %lu pages returned\n", pt_live, pt_free, pt_free_zeroed, pt_slab_pages, pt_pages_returned);
+    int order, largest = -1;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        if (buddy_nblocks[order] > 0) largest = order;
+        TracePrintf(0, "[STATS] frames: %d free blocks of %d pages\n", buddy_nblocks[order], 1 << order);
+    }
+    // fragmentation: share of free pages that lie outside the largest free block, in percent
+    TracePrintf(0, "[STATS] frames: %d free of %d, largest free block %d pages, fragmentation %d%%\n", num_free_pages, num_frames,
+        largest < 0 ? 0 : 1 << largest, num_free_pages == 0 ? 0 : 100 - 100 * (largest < 0 ? 0 : 1 << largest) / num_free_pages);
+    TracePrintf(0, "[STATS] kmap: %lu hits, %lu misses, %lu evictions\n", kmap_hits, kmap_misses, kmap_evictions);
+    TracePrintf(0, "[STATS] zero pool: %d pages, %lu hits, %lu times empty, %lu pages zeroed while idle\n", zero_pool_len, zero_pool_hits, zero_pool_empty, zero_pool_filled);
+    TracePrintf(0, "[STATS] image cache: %lu hits, %lu misses, %lu evictions, %lu bytes cached\n", image_hits, image_misses, image_evictions, image_bytes);
+    sched_group *g;
+    for (g = group_list; g != NULL; g = g->next) {
+        TracePrintf(0, "[STATS] group %d: %d shares, ran for %lu ticks\n", g->id, g->shares, g->ticks);
+    }
+    TracePrintf(0, "[STATS] real-time: %d per mille reserved, %lu deadline preemptions, %lu budget overruns, %lu rejected\n",
+        rt_util_total, rt_preemptions, rt_overruns, rt_rejected);
+    TracePrintf(0, "[STATS] scheduler: %lu switches, %lu switches avoided, %lu yields, %lu page table remaps avoided\n",
+        switches, switches_avoided, yields, pt_remaps_avoided);
+    TracePrintf(0, "[STATS] wakeups: %lu handoffs, %lu rate limited\n", handoffs, handoffs_limited);
+    int lat;
+    for (lat = 0; lat < WAKE_LAT_BUCKETS; lat++) {
+        TracePrintf(0, "[STATS] wakeups: %lu ran after %d%s ticks\n", wake_latency[lat], lat, lat == WAKE_LAT_BUCKETS - 1 ? " or more" : "");
+    }
+    TracePrintf(0, "[STATS] pids: %d of %d in use, %lu recycled, %lu reaped by WaitMany\n", pids_used, PID_SLOTS,
+        pids_recycled, reaped_batched);
+    TracePrintf(0, "[STATS] mlfq: %lu demotions, %lu boosts, %lu aged up\n", mlfq_demotions, mlfq_boosts, mlfq_aged);
+    TracePrintf(0, "[STATS] timing wheel: %lu woken, %lu cascaded, %lu cancelled\n", tw_expired, tw_cascaded, tw_cancelled);
+    TracePrintf(0, "[STATS] tlb: %lu page flushes, %lu region flushes, %lu flushes deferred\n", tlb_page_flushes, tlb_region_flushes, tlb_flushes_deferred);
+}
+
 /* Load Program */
 /*
  *  Load a program into the current process's address space.  The
@@ -1254,8 +3384,10 @@ void print_pt(){
  *  in this case.
  */
 int LoadProgram(char *name, char **args, int* brk_pn) {
+    image_entry *image;
     int fd;
-    int status;
+    long exec_offset = 0;
+    long text_skip = 0;
     struct loadinfo li;
     char *cp;
     char *cp2;
@@ -1267,31 +3399,20 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
     int text_npg;
     int data_bss_npg;
     int stack_npg;
+    struct stat st;
+    text_entry *shared_text = NULL;
     TracePrintf(0, "LoadProgram '%s', args %p\n", name, args);
-    if ((fd = open(name, O_RDONLY)) < 0) {
-        TracePrintf(0, "LoadProgram: can't open file '%s'\n", name);
+    /*
+     *  The header and the text and data bytes come from the image
+     *  cache, which only goes to the host file system when this
+     *  executable is not cached or has changed since it was read.
+     *  Executables that are not cached are read from fd as before.
+     */
+    image = image_get(name, &st, &li, &fd);
+    if (image == NULL && fd < 0) {
         return (-1);
     }
-
-    status = LoadInfo(fd, &li);
-    TracePrintf(0, "LoadProgram: LoadInfo status %d\n", status);
-    switch (status) {
-        case LI_SUCCESS:
-            break;
-        case LI_FORMAT_ERROR:
-            TracePrintf(0,
-                "LoadProgram: '%s' not in Yalnix format\n", name);
-            close(fd);
-            return (-1);
-        case LI_OTHER_ERROR:
-            TracePrintf(0, "LoadProgram: '%s' other error\n", name);
-            close(fd);
-            return (-1);
-        default:
-            TracePrintf(0, "LoadProgram: '%s' unknown error\n", name);
-            close(fd);
-            return (-1);
-    }
+    if (fd >= 0) exec_offset = lseek(fd, 0, SEEK_CUR);
     TracePrintf(0, "text_size 0x%lx, data_size 0x%lx, bss_size 0x%lx\n",
         li.text_size, li.data_size, li.bss_size);
     TracePrintf(0, "entry 0x%lx\n", li.entry);
@@ -1337,6 +3458,15 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
 
     TracePrintf(0, "LoadProgram: text_npg %d, data_bss_npg %d, stack_npg %d\n",
        text_npg, data_bss_npg, stack_npg);
+    /*
+     *  If another process is running the same executable, its text
+     *  pages are already in memory and can be mapped read-only.
+     */
+    if (text_npg > 0) {
+        shared_text = acquire_shared_text(name, &st, text_npg);
+        if (shared_text != NULL)
+            TracePrintf(0, "LoadProgram: sharing text pages of '%s'\n", name);
+    }
     /*
      *  Make sure we will leave at least one page between heap and stack
      */
@@ -1344,8 +3474,10 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
         1 + KERNEL_STACK_PAGES >= PAGE_TABLE_LEN) {
         TracePrintf(0, "LoadProgram: program '%s' size too large for VM\n",
            name);
+        release_shared_text(shared_text);
         free(argbuf);
-        close(fd);
+        image_put(image);
+        if (fd >= 0) close(fd);
         return (-1);
     }
 
@@ -1360,12 +3492,15 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
     // >>>> pages already allocated to this process that will be
     // >>>> freed below before we allocate the needed pages for
     // >>>> the new program being loaded.
-    if (text_npg + data_bss_npg + stack_npg > num_free_pages) {
+    reclaim_frames();
+    if ((demand_exec ? 0 : (shared_text == NULL ? text_npg : 0) + data_bss_npg) + stack_npg > num_free_pages + zero_pool_len) {
         TracePrintf(0,
             "LoadProgram: program '%s' size too large for physical memory\n",
             name);
+        release_shared_text(shared_text);
         free(argbuf);
-        close(fd);
+        image_put(image);
+        if (fd >= 0) close(fd);
         return (-1);
     }
     ExceptionStackFrame *frame = (ExceptionStackFrame *)((long)EXCEPTION_FRAME_ADDR);
@@ -1383,11 +3518,20 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
     // >>>> any of these PTEs that are valid, free the physical memory
     // >>>> memory page indicated by that PTE's pfn field.  Set all
     // >>>> of these PTEs to be no longer valid.
+    shm_detach_all();
+    tlb_batch_begin();
     for (i = MEM_INVALID_PAGES; i < KERNEL_STACK_BASE >> PAGESHIFT; i++) {
-        if (region_0_pt[i].valid) {
-            free_page_enq(0, i);
-        }
-    }
+        release_user_page(i);
+    }
+    tlb_batch_end();
+    release_shared_text(running_block->text);
+    running_block->text = shared_text;
+    image_put(running_block->image);
+    running_block->image = image;   // released with the process if loading fails from here on
+    if (running_block->exec_fd >= 0) close(running_block->exec_fd);
+    running_block->exec_fd = fd;
+    running_block->exec_pending = 0;
+    running_block->exec_npg = 0;
     /*
      *  Fill in the page table with the right number of text,
      *  data+bss, and stack pages.  We set all the text pages
@@ -1410,9 +3554,14 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
     // >>>>     pfn   = a new page of physical memory
     for (i = MEM_INVALID_PAGES; i < MEM_INVALID_PAGES + text_npg; i++) {
         *brk_pn = *brk_pn + 1;
+        if (shared_text != NULL && shared_text->pfns[i - MEM_INVALID_PAGES] != -1) {
+            set_pte(REGION_0, i, PROT_READ | PROT_EXEC, PROT_READ | PROT_EXEC, shared_text->pfns[i - MEM_INVALID_PAGES]);
+            frame_refcnt[shared_text->pfns[i - MEM_INVALID_PAGES]]++;
+            continue;
+        }
+        if (demand_exec) continue;  // loaded on first touch
         if (free_page_deq(REGION_0, i, PROT_READ | PROT_WRITE, PROT_READ | PROT_EXEC) < 0) {
             free(argbuf);
-            close(fd);
             return (-2);
         }
     }
@@ -1427,9 +3576,9 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
 
     for (i = MEM_INVALID_PAGES + text_npg; i < MEM_INVALID_PAGES + text_npg + data_bss_npg; i++) {
         *brk_pn = *brk_pn + 1;
+        if (demand_exec) continue;  // loaded or zero filled on first touch
         if (free_page_deq(REGION_0, i, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE) < 0) {
             free(argbuf);
-            close(fd);
             return (-2);
         }
     }
@@ -1446,54 +3595,100 @@ int LoadProgram(char *name, char **args, int* brk_pn) {
 
     for (i = 0; i < stack_npg; i++) {
         int index = (USER_STACK_LIMIT >> PAGESHIFT) - 1 - i;
-        if (free_page_deq(REGION_0, index, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE) < 0) {
+        // only the arguments get written, the rest must not show what a previous owner left
+        if (map_zeroed_page(index, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE) < 0) {
             free(argbuf);
-            close(fd);
             return (-2);
         }
     }
     /*
-     *  All pages for the new address space are now in place.  Flush
-     *  the TLB to get rid of all the old PTEs from this process, so
-     *  we'll be able to do the read() into the new pages below.
-     */
-    WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_0);
-
-    /*
-     *  Read the text and data from the file into memory.
-     */
-    if (read(fd, (void *)MEM_INVALID_SIZE, li.text_size+li.data_size)
-        != li.text_size+li.data_size) {
-        TracePrintf(0, "LoadProgram: couldn't read for '%s'\n", name);
-        free(argbuf);
-        close(fd);
-    // >>>> Since we are returning -2 here, this should mean to
-    // >>>> the rest of the kernel that the current process should
-    // >>>> be terminated with an exit status of ERROR reported
-    // >>>> to its parent process.
-        return (-2);
-    }
-
-    close(fd);          /* we've read it all now */
-
-    /*
-     *  Now set the page table entries for the program text to be readable
-     *  and executable, but not writable.
+     *  All pages for the new address space are now in place.  The old
+     *  PTEs of this process were flushed from the TLB when the batch
+     *  above was closed, and newly validated PTEs need no flush, so
+     *  we can do the read() into the new pages right away.
      */
-    // >>>> For text_npg number of PTEs corresponding to the user text
-    // >>>> pages, set each PTE's kprot to PROT_READ | PROT_EXEC.
-    for (i = MEM_INVALID_PAGES; i < MEM_INVALID_PAGES + text_npg; i++) {
-        region_0_pt[i].kprot = PROT_READ | PROT_EXEC;
-    }
-
-    WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_0);
 
     /*
-     *  Zero out the bss
+     *  In demand exec mode the image or the file stays referenced and
+     *  nothing is copied now; trap_memory_handler fills the pages on
+     *  first touch, and the image or file is let go once every page
+     *  that comes from it is resident.
      */
-    memset((void *)(MEM_INVALID_SIZE + li.text_size + li.data_size),
-         '\0', li.bss_size);
-
+    running_block->exec_offset = exec_offset;
+    running_block->exec_size = li.text_size + li.data_size;
+    running_block->exec_text_npg = text_npg;
+    running_block->exec_npg = text_npg + data_bss_npg;
+    if (demand_exec) {
+        for (i = MEM_INVALID_PAGES; ((long)(i - MEM_INVALID_PAGES) << PAGESHIFT) < running_block->exec_size; i++) {
+            if (!region_0_pt[i].valid) running_block->exec_pending++;
+        }
+        exec_pages_loaded(0);
+    } else if (image != NULL) {
+        /*
+         *  Copy the text and data from the cached image into memory.
+         *  Text pages that are shared with another process are already
+         *  in place and skipped.
+         */
+        for (i = 0; i < text_npg; i++) {
+            if (shared_text != NULL && shared_text->pfns[i] != -1) continue;
+            memcpy((void *)(MEM_INVALID_SIZE + ((long)i << PAGESHIFT)), image->bytes + ((long)i << PAGESHIFT), PAGESIZE);
+        }
+        memcpy((void *)(MEM_INVALID_SIZE + ((long)text_npg << PAGESHIFT)), image->bytes + ((long)text_npg << PAGESHIFT),
+            li.text_size + li.data_size - ((long)text_npg << PAGESHIFT));
+        exec_pages_loaded(0);   // nothing is loaded on first touch
+    } else {
+        /*
+         *  Read the text and data from the file into memory.  Text pages
+         *  that are shared with another process are skipped; the ones it
+         *  has not loaded yet are read one by one.
+         */
+        if (shared_text != NULL) {
+            for (i = 0; i < text_npg; i++) {
+                if (shared_text->pfns[i] != -1) continue;
+                if (pread(fd, (void *)(MEM_INVALID_SIZE + ((long)i << PAGESHIFT)), PAGESIZE, exec_offset + ((long)i << PAGESHIFT)) != PAGESIZE) {
+                    TracePrintf(0, "LoadProgram: couldn't read text for '%s'\n", name);
+                    free(argbuf);
+                    return (-2);
+                }
+            }
+            text_skip = (long)text_npg << PAGESHIFT;
+        }
+        if (pread(fd, (void *)(MEM_INVALID_SIZE + text_skip), li.text_size+li.data_size-text_skip, exec_offset + text_skip)
+            != li.text_size+li.data_size-text_skip) {
+            TracePrintf(0, "LoadProgram: couldn't read for '%s'\n", name);
+            free(argbuf);
+        // >>>> Since we are returning -2 here, this should mean to
+        // >>>> the rest of the kernel that the current process should
+        // >>>> be terminated with an exit status of ERROR reported
+        // >>>> to its parent process.
+            return (-2);
+        }
+        exec_pages_loaded(0);   // we've read it all now
+
+        /*
+         *  Now set the page table entries for the program text to be readable
+         *  and executable, but not writable.
+         */
+        // >>>> For text_npg number of PTEs corresponding to the user text
+        // >>>> pages, set each PTE's kprot to PROT_READ | PROT_EXEC.
+        tlb_batch_begin();
+        for (i = MEM_INVALID_PAGES; i < MEM_INVALID_PAGES + text_npg; i++) {
+            if (region_0_pt[i].kprot == (PROT_READ | PROT_EXEC)) continue;     // shared text is already mapped this way
+            region_0_pt[i].kprot = PROT_READ | PROT_EXEC;
+            tlb_flush_page(REGION_0, i);
+        }
+        tlb_batch_end();
+
+        /*
+         *  Zero out the bss
+         */
+        memset((void *)(MEM_INVALID_SIZE + li.text_size + li.data_size),
+             '\0', li.bss_size);
+    }
+    if (running_block->text == NULL && text_npg > 0)
+        running_block->text = add_shared_text(name, &st, text_npg);
+    if (running_block->text != NULL)
+        publish_text_pages(running_block->text);
 
     /*
      *  Set the entry point in the exception frame.
@@ -34,6 +34,25 @@
 #define YALNIX_WRITE_SECTOR	41
 #define YALNIX_DISK_STATS	42
 
+/* Kernel call numbers below here are extensions of this kernel */
+
+#define YALNIX_SHM_CREATE	50
+#define YALNIX_SHM_ATTACH	51
+#define YALNIX_SHM_DETACH	52
+#define YALNIX_SPAWN		53
+#define YALNIX_SET_QUANTUM	54
+#define YALNIX_SET_SHARES	55
+#define YALNIX_DELAY_UNTIL	56
+#define YALNIX_SET_REAL_TIME	57
+#define YALNIX_YIELD		58
+#define YALNIX_WAIT_PID		59
+#define YALNIX_WAIT_MANY	60
+
+/*
+ *  Flags for WaitPid(pid, &status, flags) and WaitMany(pids, statuses, max, flags)
+ */
+#define WAIT_NOHANG		0x1	/* return 0 rather than block */
+
 /*
  *  All Yalnix kernel calls return ERROR in case of any error.
  */
@@ -88,6 +107,17 @@ extern int CopyTo(int, void *, void *, int);
 extern int ReadSector(int, void *);
 extern int WriteSector(int, void *);
 extern int DiskStats(struct diskstats *);
+extern int ShmCreate(int);
+extern int ShmAttach(int, void *);
+extern int ShmDetach(void *);
+extern int Spawn(char *, char **);
+extern int SetQuantum(int, int);
+extern int SetShares(int, int);
+extern int DelayUntil(int);
+extern int SetRealTime(int, int);
+extern int Yield(void);
+extern int WaitPid(int, int *, int);
+extern int WaitMany(int *, int *, int, int);
 
 /*
  *  A Yalnix library function: TtyPrintf(num, format, args) works like
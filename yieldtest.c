@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include "yalnix.h"
+#include <comp421/hardware.h>
+
+#define NUM_ROUNDS	5
+
+int
+main(int argc, char **argv)
+{
+    int pid;
+    int status;
+    int i;
+
+    setbuf(stdout, NULL);
+
+    printf("YIELD> This program tests Yield\n");
+
+    /* nothing else is ready yet, Yield must come straight back */
+    if (Yield() == ERROR) {
+	printf("YIELD> Yield failed!!\n");
+	Exit(1);
+    }
+
+    if ((pid = Fork()) == 0) {
+	for (i = 0; i < NUM_ROUNDS; i++) {
+	    printf("YIELD> CHILD round %d\n", i);
+	    Yield();
+	}
+	Exit(0);
+    }
+
+    for (i = 0; i < NUM_ROUNDS; i++) {
+	printf("YIELD> PARENT round %d\n", i);
+	Yield();
+    }
+
+    Wait(&status);
+    printf("YIELD> DONE!\n");
+    Exit(0);
+}